@@ -0,0 +1,38 @@
+// Build-time generator for the slice-by-8 CRC32 tables.
+// Usage: ./gen_crc32_tables > crc32_tables.c
+#include <stdio.h>
+#include <stdint.h>
+
+int main(void) {
+    uint32_t tab[8][256];
+    
+    // tab[0] is the classic byte-wise table for polynomial 0xEDB88320;
+    // tab[k][i] advances tab[k - 1][i] by one more zero byte
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int j = 0; j < 8; j++) {
+            c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+        }
+        tab[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t prev = tab[k - 1][i];
+            tab[k][i] = tab[0][prev & 0xFF] ^ (prev >> 8);
+        }
+    }
+    
+    printf("// Generated by gen_crc32_tables. Do not edit.\n");
+    printf("#include \"minivsfs.h\"\n\n");
+    printf("const uint32_t CRC32_TAB[8][256] = {\n");
+    for (int k = 0; k < 8; k++) {
+        printf("    {\n");
+        for (int i = 0; i < 256; i++) {
+            printf("%s0x%08xu%s", (i % 8 == 0) ? "        " : " ", tab[k][i],
+                   (i == 255) ? "\n" : ((i % 8 == 7) ? ",\n" : ","));
+        }
+        printf("    }%s\n", (k == 7) ? "" : ",");
+    }
+    printf("};\n");
+    return 0;
+}
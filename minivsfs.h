@@ -2,6 +2,7 @@
 #define MINIVSFS_H
 
 #define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -11,29 +12,59 @@
 #include <sys/stat.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 // File system constants
 #define BS 4096u               // Block size
 #define INODE_SIZE 128u        // Inode size in bytes
 #define ROOT_INO 1u           // Root inode number
 #define DIRECT_MAX 12         // Maximum direct block pointers
+#define PTRS_PER_BLOCK (BS / 4)  // Block pointers in an indirect block
+#define FILE_MAX_BLOCKS (DIRECT_MAX + PTRS_PER_BLOCK + (uint64_t)PTRS_PER_BLOCK * PTRS_PER_BLOCK)
+#define INODE_EXTENTS 6          // Extents held in the inode itself
+#define EXTENTS_PER_BLOCK (BS / 8)  // Extents in an overflow extent block
+#define INLINE_DATA_MAX 60       // Largest file stored inside its inode
+#define DIRENTS_PER_BLOCK (BS / 64)  // Directory entries in one directory block
+#define DIRENT_NAME_MAX 57       // Longest name a directory entry holds
+#define DIR_INDEX_MAGIC 0x58444948u  // "HIDX" directory index header
+#define DIR_INDEX_ROOT_OFFSET 128    // Index root after "." and ".." in block 0
+#define DIR_INDEX_LEVELS_MAX 1
+#define DIR_PREALLOC_MAX 32          // Most spare blocks a directory takes at once
 #define MAGIC_NUMBER 0x4D565346  // "MVSF" magic number
-#define VERSION 1             // File system version
+#define VERSION 5             // File system version
 #define PROJ_ID 7             // Project ID
 
 // File type constants
 #define FILE_TYPE_REGULAR 1
 #define FILE_TYPE_DIRECTORY 2
 
+// Superblock feature flags (version 4+). Images with flags this build does
+// not know are refused, since they may lay data out differently.
+#define FS_FLAG_EXTENTS 0x1u      // Inodes map data with extents, not block pointers
+#define FS_FLAG_INLINE_DATA 0x2u  // Files up to INLINE_DATA_MAX bytes live in the inode
+#define FS_FLAG_BLOCK_GROUPS 0x4u // Layout split into block groups (version 5+)
+#define FS_FLAG_DIR_INDEX 0x8u    // Directories carry a hashed name index
+#define FS_FLAGS_SUPPORTED (FS_FLAG_EXTENTS | FS_FLAG_INLINE_DATA | FS_FLAG_BLOCK_GROUPS | \
+                            FS_FLAG_DIR_INDEX)
+
 // Mode constants
 #define MODE_FILE 0100000     // Regular file mode
 #define MODE_DIR 0040000      // Directory mode
 
 // Validation constants
 #define MIN_SIZE_KIB 180
-#define MAX_SIZE_KIB 4096
+#define MAX_SIZE_KIB (1ull << 30)  // 1 TiB; block numbers and bitmap bits stay 32-bit
 #define MIN_INODES 128
-#define MAX_INODES 512
+#define MAX_INODES (1u << 24)
+#define BITS_PER_BLOCK (BS * 8)   // Bitmap bits in one block
+
+// Run of contiguous bitmap bits (e.g. data blocks relative to the data region)
+typedef struct {
+    uint32_t start;
+    uint32_t length;
+} extent_t;
 
 // Packed structures for file system layout
 #pragma pack(push, 1)
@@ -45,16 +76,21 @@ typedef struct {
     uint64_t total_blocks;
     uint64_t inode_count;
     uint64_t inode_bitmap_start;      // block 1
-    uint64_t inode_bitmap_blocks;     // 1
-    uint64_t data_bitmap_start;       // block 2
-    uint64_t data_bitmap_blocks;      // 1
-    uint64_t inode_table_start;       // block 3
+    uint64_t inode_bitmap_blocks;     // ceil(inode_count / (BS * 8))
+    uint64_t data_bitmap_start;       // after the inode bitmap
+    uint64_t data_bitmap_blocks;      // ceil(data_region_blocks / (BS * 8))
+    uint64_t inode_table_start;       // after the data bitmap
     uint64_t inode_table_blocks;
     uint64_t data_region_start;
     uint64_t data_region_blocks;
     uint64_t root_inode;              // 1
     uint64_t mtime_epoch;             
-    uint32_t flags;                   // 0
+    uint32_t flags;                   // FS_FLAG_* feature flags
+    uint32_t inode_alloc_hint;        // Inode bitmap bit to try first (version 2+)
+    uint32_t data_alloc_hint;         // Data bitmap bit to try first (version 2+)
+    uint32_t group_count;             // Block groups (version 5+, FS_FLAG_BLOCK_GROUPS), else 0
+    uint32_t blocks_per_group;        // Blocks in each group but possibly the last
+    uint32_t inodes_per_group;
     
     // THIS FIELD SHOULD STAY AT THE END
     // ALL OTHER FIELDS SHOULD BE ABOVE THIS
@@ -70,10 +106,19 @@ typedef struct {
     uint64_t atime;                   // Build time (Unix Epoch)
     uint64_t mtime;                   // Build time (Unix Epoch)
     uint64_t ctime;                   // Build time (Unix Epoch)
-    uint32_t direct[12];              // Direct block pointers
-    uint32_t reserved_0;              // 0
-    uint32_t reserved_1;              // 0
-    uint32_t reserved_2;              // 0
+    union {
+        struct {
+            union {
+                uint32_t direct[12];  // Direct block pointers
+                extent_t extents[INODE_EXTENTS];  // With FS_FLAG_EXTENTS: absolute runs, length 0 ends
+            };
+            uint32_t indirect;        // Single-indirect block (version 3+, else 0), or the
+                                      // overflow extent block with FS_FLAG_EXTENTS
+            uint32_t double_indirect; // Double-indirect block (version 3+, else 0)
+            uint32_t reserved_2;      // 0
+        };
+        uint8_t inline_data[INLINE_DATA_MAX];  // Contents of small files with FS_FLAG_INLINE_DATA
+    };
     uint32_t proj_id;                 // gpr 7
     uint32_t uid16_gid16;             // 0
     uint64_t xattr_ptr;               // 0
@@ -91,53 +136,309 @@ typedef struct {
     uint8_t  checksum; // XOR of bytes 0..62
 } dirent64_t;
 
+// Hashed directory index (FS_FLAG_DIR_INDEX). Block 0 of an indexed
+// directory holds "." and "..", then at DIR_INDEX_ROOT_OFFSET a header and
+// index entries sorted by hash: entry i covers names whose crc32 lies in
+// [hash_i, hash_i+1) and names the directory block that holds them. With
+// levels 1 the root entries name index node blocks (header plus entries)
+// and those name the leaf blocks; leaves are plain dirent64_t arrays.
+typedef struct {
+    uint32_t magic;                   // DIR_INDEX_MAGIC
+    uint8_t  levels;                  // Index node levels below the root (0 or 1)
+    uint8_t  reserved_0[3];
+    uint16_t count;                   // Entries in use
+    uint16_t limit;                   // Entries that fit
+    uint32_t blocks_used;             // Root only: directory blocks in use, the rest are spare
+} dir_index_header_t;
+
+typedef struct {
+    uint32_t hash;                    // Lowest name hash this entry covers
+    uint32_t block;                   // Directory block (index into the block map)
+} dir_index_entry_t;
+
+// Block group descriptor (FS_FLAG_BLOCK_GROUPS). The descriptor table
+// starts at block 1, right after the superblock; each group holds a
+// one-block inode bitmap, a one-block data bitmap, its slice of the inode
+// table and its data region, in that order.
+typedef struct {
+    uint64_t inode_bitmap_start;
+    uint64_t data_bitmap_start;
+    uint64_t inode_table_start;
+    uint64_t data_region_start;
+    uint32_t data_region_blocks;
+    uint32_t free_inodes;             // Refreshed on every commit
+    uint32_t free_data_blocks;        // Refreshed on every commit
+    uint8_t  reserved[16];
+    
+    // THIS FIELD SHOULD STAY AT THE END
+    uint32_t checksum;                // crc32 of bytes [0..59]
+} group_desc_t;
+
 #pragma pack(pop)
 
 // Static assertions for structure sizes
-_Static_assert(sizeof(superblock_t) == 116, "superblock must fit in one block");
+_Static_assert(sizeof(superblock_t) == 136, "superblock must fit in one block");
+_Static_assert(sizeof(group_desc_t) == 64, "group descriptor size mismatch");
 _Static_assert(sizeof(inode_t) == INODE_SIZE, "inode size mismatch");
 _Static_assert(sizeof(dirent64_t) == 64, "dirent size mismatch");
+_Static_assert(DIRENTS_PER_BLOCK * sizeof(dirent64_t) == BS, "directory block must hold whole entries");
+_Static_assert(sizeof(dir_index_header_t) == 16, "directory index header size mismatch");
+_Static_assert(sizeof(dir_index_entry_t) == 8, "directory index entry size mismatch");
+_Static_assert(DIR_INDEX_ROOT_OFFSET == 2 * sizeof(dirent64_t), "index root must follow . and ..");
+
+// In-memory summary levels over an on-disk bitmap for fast free-bit lookup
+#define BITMAP_INDEX_MAX_LEVELS 6
+typedef struct {
+    uint8_t* bitmap;                  // Indexed bitmap (not owned)
+    uint32_t max_bits;
+    int levels;
+    uint32_t level_bits[BITMAP_INDEX_MAX_LEVELS];
+    uint64_t* level[BITMAP_INDEX_MAX_LEVELS];  // level[0]: one bit per bitmap word
+    uint64_t* storage;
+} bitmap_index_t;
+
+// Free runs of a bitmap, sorted by start and by (length, start)
+typedef struct {
+    extent_t* by_start;
+    extent_t* by_length;
+    uint32_t count;
+    uint32_t capacity;
+    uint64_t free_blocks;
+} free_extents_t;
+
+// How image_create() backs the image file on the host
+typedef enum {
+    IMAGE_ALLOC_SPARSE = 0,           // ftruncate only; unused blocks are holes
+    IMAGE_ALLOC_ZERO_FILL,            // Write zeros to every block
+    IMAGE_ALLOC_PREALLOCATE           // Reserve every block with posix_fallocate
+} image_alloc_t;
+
+// One thread's position in the inode and data bitmaps for the concurrent
+// allocator; each thread keeps its own so threads rarely share a word
+typedef struct {
+    uint32_t inode_group;
+    uint32_t inode_word;
+    uint32_t data_group;
+    uint32_t data_word;
+} alloc_cursor_t;
+
+// A file whose inode and blocks are allocated but whose content is not
+// read yet
+typedef struct {
+    const char* path;                 // Host file to read
+    uint64_t size;
+    uint32_t inode_num;
+    extent_t* runs;                   // Data blocks in file order; none if inline
+    uint32_t run_count;
+    extent_t* extents;                // Every block taken, for rollback
+    int extent_count;
+} file_copy_t;
 
 // Command line argument structures
 typedef struct {
     char* input_image;
     char* output_image;
-    char* filename;
+    char** filenames;                 // Files to add, in command line order
+    char** dest_paths;                // Where each file goes, relative to the root
+    size_t file_count;
+    size_t file_capacity;
+    const char* dest_dir;             // --dest for the files named after it
+    int parents;                      // --parents: keep the path given to --file
+    int stats;                        // --stats: report free space after adding
 } cli_args_adder_t;
 
 typedef struct {
     char* image_name;
-    uint32_t size_kib;
+    uint64_t size_kib;
     uint32_t inode_count;
+    image_alloc_t alloc_mode;
+    uint32_t flags;                   // FS_FLAG_* features to enable
+    uint32_t group_blocks;            // Blocks per group with FS_FLAG_BLOCK_GROUPS
+    const char* from_dir;             // Host directory to copy into the image
+    uint32_t jobs;                    // Threads reading files for --from-dir
 } cli_args_builder_t;
 
 // File system layout structure
 typedef struct {
     uint64_t total_blocks;
+    uint64_t inode_bitmap_blocks;
+    uint64_t data_bitmap_blocks;
     uint64_t inode_table_blocks;
     uint64_t data_region_blocks;
     uint64_t superblock_start;        // 0
     uint64_t inode_bitmap_start;      // 1
-    uint64_t data_bitmap_start;       // 2
-    uint64_t inode_table_start;       // 3
-    uint64_t data_region_start;       // 3 + inode_table_blocks
+    uint64_t data_bitmap_start;       // 1 + inode_bitmap_blocks
+    uint64_t inode_table_start;       // data_bitmap_start + data_bitmap_blocks
+    uint64_t data_region_start;       // inode_table_start + inode_table_blocks
+    uint64_t inode_count;
+    uint32_t group_count;             // 0 for a flat layout
+    uint32_t blocks_per_group;
+    uint32_t inodes_per_group;
+    uint64_t group_desc_blocks;
 } fs_layout_t;
 
+// Block range modified since the last flush
+typedef struct {
+    uint64_t first_block;
+    uint64_t block_count;
+} dirty_range_t;
+
+// One allocation group of a mapped image. A flat image is a single group
+// made of the regions named in the superblock.
+typedef struct {
+    uint8_t* inode_bitmap;
+    uint8_t* data_bitmap;
+    inode_t* inode_table;
+    uint64_t inode_bitmap_start;
+    uint64_t data_bitmap_start;
+    uint64_t inode_table_start;
+    uint64_t data_region_start;
+    uint32_t first_inode;             // Inode number of the group's first inode
+    uint32_t inode_count;
+    uint32_t data_region_blocks;
+    uint32_t data_base;               // Group's first data bit in data_alloc_hint terms
+    bitmap_index_t inode_index;       // Built by image_open()
+    bitmap_index_t data_index;
+    free_extents_t data_extents;      // Free data runs, built by image_open()
+} fs_group_t;
+
+// Memory-mapped file system image. The typed views point straight into the
+// mapping, so metadata is read and modified in place.
+typedef struct {
+    int fd;
+    int writable;
+    uint8_t* base;                    // Start of the mapping (block 0)
+    uint64_t total_blocks;
+    superblock_t* sb;
+    fs_group_t* groups;
+    uint32_t group_count;
+    uint32_t inodes_per_group;
+    uint32_t inode_alloc_hint;        // Next-fit cursors, stored on commit
+    uint32_t data_alloc_hint;
+    dirty_range_t* dirty;
+    size_t dirty_count;
+    size_t dirty_capacity;
+} fs_image_t;
+
 // CRC32 functions
-extern uint32_t CRC32_TAB[256];
-void crc32_init(void);
+extern const uint32_t CRC32_TAB[8][256];   // Generated into crc32_tables.c
 uint32_t crc32(const void* data, size_t n);
 
 // Checksum functions
 uint32_t superblock_crc_finalize(superblock_t *sb);
+void group_desc_crc_finalize(group_desc_t* desc);
 void inode_crc_finalize(inode_t* ino);
 void dirent_checksum_finalize(dirent64_t* de);
 
+// Image access functions (return 0 on success, -1 on error)
+int image_create(fs_image_t* img, const char* path, uint64_t total_blocks, image_alloc_t alloc_mode);
+int image_open(fs_image_t* img, const char* path, int writable);
+int image_attach_views(fs_image_t* img);
+int image_build_indexes(fs_image_t* img);
+void image_update_group_descs(fs_image_t* img);
+void image_update_superblock(fs_image_t* img, time_t now);
+uint8_t* image_block(fs_image_t* img, uint64_t block_no);
+group_desc_t* image_group_desc(fs_image_t* img, uint32_t group);
+inode_t* image_inode(fs_image_t* img, uint32_t inode_num);
+uint32_t image_inode_group(const fs_image_t* img, uint32_t inode_num);
+int image_mark_dirty(fs_image_t* img, uint64_t first_block, uint64_t block_count);
+int image_mark_inode_dirty(fs_image_t* img, uint32_t inode_num);
+int image_flush(fs_image_t* img);
+int image_close(fs_image_t* img);
+
+// Allocation functions (bitmaps, indexes and dirty ranges kept in step)
+uint32_t image_alloc_inode(fs_image_t* img, uint32_t preferred_group);
+void image_free_inode(fs_image_t* img, uint32_t inode_num);
+int image_alloc_blocks(fs_image_t* img, uint32_t preferred_group, uint64_t count,
+                       extent_t* extents, int max_extents);
+void image_free_blocks(fs_image_t* img, uint64_t first_block, uint32_t block_count);
+uint32_t image_dir_group(const fs_image_t* img, uint32_t parent_group);
+uint64_t image_free_inode_count(const fs_image_t* img);
+uint64_t image_free_block_count(const fs_image_t* img);
+uint64_t image_free_extent_count(const fs_image_t* img);
+uint32_t image_largest_free_extent(const fs_image_t* img);
+
+// Inode block map functions
+int inode_is_inline(const fs_image_t* img, const inode_t* inode);
+uint64_t inode_map_blocks(uint64_t block_count);
+uint32_t inode_block_at(fs_image_t* img, const inode_t* inode, uint64_t file_block);
+void inode_set_blocks(fs_image_t* img, inode_t* inode, const uint32_t* blocks,
+                      uint64_t block_count, uint32_t* data_blocks);
+const extent_t* inode_extent(fs_image_t* img, const inode_t* inode, uint32_t index);
+void inode_set_extents(fs_image_t* img, inode_t* inode, const extent_t* extents,
+                       uint32_t extent_count, uint32_t overflow_block);
+uint32_t inode_append_blocks(fs_image_t* img, inode_t* inode, uint64_t file_block, uint32_t count,
+                             uint32_t preferred_group, uint32_t* appended);
+
+// Directory functions
+uint32_t dir_name_hash(const char* name);
+void dir_index_init(uint8_t* dir_block);
+int dir_is_indexed(fs_image_t* img, const inode_t* dir);
+uint64_t dir_block_count(fs_image_t* img, const inode_t* dir);
+uint64_t dir_free_slots(fs_image_t* img, uint32_t dir_ino);
+dirent64_t* dir_lookup(fs_image_t* img, uint32_t dir_ino, const char* name);
+int dir_add_entry(fs_image_t* img, uint32_t dir_ino, uint32_t inode_num, uint8_t type,
+                  const char* name, time_t now);
+void dir_init(fs_image_t* img, inode_t* inode, uint32_t self, uint32_t parent, uint32_t block_no,
+              time_t now);
+uint32_t dir_alloc(fs_image_t* img, uint32_t parent_ino, time_t now);
+void dir_release(fs_image_t* img, uint32_t dir_ino);
+int dir_link(fs_image_t* img, uint32_t parent_ino, uint32_t dir_ino, const char* name, time_t now);
+uint32_t dir_create(fs_image_t* img, uint32_t parent_ino, const char* name, time_t now);
+uint64_t dir_growth_blocks(uint32_t fs_flags, int indexed, uint64_t block_count, uint64_t free_slots,
+                           uint64_t entry_count);
+int dir_reserve(fs_image_t* img, uint32_t dir_ino, uint64_t block_count);
+
+// File functions
+void file_inode_init(inode_t* inode, uint64_t file_size, time_t now);
+int file_is_inline(uint32_t fs_flags, uint64_t file_size);
+uint64_t file_blocks_needed(uint32_t fs_flags, uint64_t file_size);
+int image_alloc_file(fs_image_t* img, uint32_t parent_ino, const char* path, uint64_t file_size,
+                     time_t now, file_copy_t* copy);
+int file_copy_read(fs_image_t* img, const file_copy_t* copy);
+void image_release_file(fs_image_t* img, file_copy_t* copy);
+void file_copy_free(file_copy_t* copy);
+
 // Utility functions
-int find_free_bit(uint8_t* bitmap, uint32_t max_bits);
 void set_bit(uint8_t* bitmap, int bit_number);
+void clear_bit(uint8_t* bitmap, int bit_number);
+void set_bit_range(uint8_t* bitmap, uint32_t start, uint32_t length);
+void clear_bit_range(uint8_t* bitmap, uint32_t start, uint32_t length);
+uint64_t count_free_bits(const uint8_t* bitmap, uint32_t max_bits);
 const char* extract_filename(const char* path);
 uint8_t* read_file_content(const char* filename, uint64_t* file_size);
+int read_exact(int fd, uint64_t offset, uint8_t* dst, uint64_t size);
+
+// Bitmap index functions
+int bitmap_index_build(bitmap_index_t* index, uint8_t* bitmap, uint32_t max_bits);
+void bitmap_index_free(bitmap_index_t* index);
+uint32_t bitmap_index_find_next(const bitmap_index_t* index, uint32_t start);
+int bitmap_index_find_free(const bitmap_index_t* index, uint32_t start);
+void bitmap_index_set_range(bitmap_index_t* index, uint32_t start, uint32_t length);
+void bitmap_index_clear_range(bitmap_index_t* index, uint32_t start, uint32_t length);
+
+// Concurrent bitmap and allocation functions
+int atomic_claim_bit(uint8_t* bitmap, uint32_t bit);
+void atomic_release_bits(uint8_t* bitmap, uint32_t start, uint32_t length);
+int64_t atomic_claim_run(uint8_t* bitmap, uint32_t max_bits, uint32_t count, uint32_t* cursor,
+                         uint32_t* claimed);
+int image_concurrent_begin(fs_image_t* img);
+int image_concurrent_end(fs_image_t* img);
+void alloc_cursor_init(const fs_image_t* img, alloc_cursor_t* cursor, uint32_t thread,
+                       uint32_t thread_count);
+uint32_t image_claim_inode(fs_image_t* img, alloc_cursor_t* cursor);
+uint32_t image_claim_blocks(fs_image_t* img, alloc_cursor_t* cursor, uint32_t count, uint32_t* claimed);
+void image_unclaim_inode(fs_image_t* img, uint32_t inode_num);
+void image_unclaim_blocks(fs_image_t* img, uint32_t first_block, uint32_t count);
+
+// Free-extent index functions
+int free_extents_build(free_extents_t* fe, const uint8_t* bitmap, uint32_t max_bits);
+void free_extents_free(free_extents_t* fe);
+int free_extents_alloc(free_extents_t* fe, uint32_t count, extent_t* extents, int max_extents,
+                       uint32_t hint);
+int free_extents_reserve(free_extents_t* fe, uint32_t start, uint32_t length);
+int free_extents_release(free_extents_t* fe, uint32_t start, uint32_t length);
+uint32_t free_extents_largest(const free_extents_t* fe);
 
 // Error handling
 void print_error(const char* format, ...);
@@ -1,69 +1,1989 @@
 #include "minivsfs.h"
 #include <stdarg.h>
 
-// CRC32 implementation
-uint32_t CRC32_TAB[256];
+// CRC32 implementation (slice-by-8). CRC32_TAB is generated at build time
+// by gen_crc32_tables into crc32_tables.c: CRC32_TAB[0] is the classic
+// byte-wise table and CRC32_TAB[k][i] advances CRC32_TAB[k - 1][i] by one more
+// zero byte, so eight input bytes can be folded in per iteration.
 
-void crc32_init(void) {
-    for (uint32_t i = 0; i < 256; i++) {
-        uint32_t c = i;
-        for (int j = 0; j < 8; j++) {
-            c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+// Table-driven update of a running (pre-inverted) CRC register
+static uint32_t crc32_update_table(uint32_t c, const uint8_t* p, size_t n) {
+    while (n >= 8) {
+        uint32_t lo = c ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+                           (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        uint32_t hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 |
+                      (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+        c = CRC32_TAB[7][lo & 0xFF] ^ CRC32_TAB[6][(lo >> 8) & 0xFF] ^
+            CRC32_TAB[5][(lo >> 16) & 0xFF] ^ CRC32_TAB[4][lo >> 24] ^
+            CRC32_TAB[3][hi & 0xFF] ^ CRC32_TAB[2][(hi >> 8) & 0xFF] ^
+            CRC32_TAB[1][(hi >> 16) & 0xFF] ^ CRC32_TAB[0][hi >> 24];
+        p += 8;
+        n -= 8;
+    }
+    
+    for (size_t i = 0; i < n; i++) {
+        c = CRC32_TAB[0][(c ^ p[i]) & 0xFF] ^ (c >> 8);
+    }
+    return c;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <cpuid.h>
+#include <immintrin.h>
+
+// Carry-less multiply folding (Intel, "Fast CRC Computation for Generic
+// Polynomials Using PCLMULQDQ Instruction"), with the bit-reflected
+// constants for polynomial 0xEDB88320. Needs n >= 64 and n % 16 == 0.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_fold_pclmul(uint32_t c, const uint8_t* p, size_t n) {
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    
+    __m128i x1 = _mm_loadu_si128((const __m128i*)(p + 0x00));
+    __m128i x2 = _mm_loadu_si128((const __m128i*)(p + 0x10));
+    __m128i x3 = _mm_loadu_si128((const __m128i*)(p + 0x20));
+    __m128i x4 = _mm_loadu_si128((const __m128i*)(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)c));
+    p += 64;
+    n -= 64;
+    
+    // Fold four 128-bit lanes forward by 512 bits per 64-byte chunk
+    while (n >= 64) {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(p + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(p + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(p + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(p + 0x30)));
+        p += 64;
+        n -= 64;
+    }
+    
+    // Fold the four lanes into one
+    __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+    
+    // Remaining 16-byte blocks
+    while (n >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)p)), x5);
+        p += 16;
+        n -= 16;
+    }
+    
+    // Reduce 128 -> 64 bits
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask32);
+    x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    
+    // Barrett reduction to 32 bits
+    x2 = _mm_and_si128(x1, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_update_pclmul(uint32_t c, const uint8_t* p, size_t n) {
+    if (n >= 64) {
+        size_t chunk = n & ~(size_t)15;
+        c = crc32_fold_pclmul(c, p, chunk);
+        p += chunk;
+        n -= chunk;
+    }
+    return crc32_update_table(c, p, n);
+}
+
+static int cpu_has_pclmul(void) {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+    return (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1);
+}
+#endif
+
+typedef uint32_t (*crc32_update_fn)(uint32_t c, const uint8_t* p, size_t n);
+
+// Pick the fastest implementation for this CPU on first use
+static uint32_t crc32_update_resolve(uint32_t c, const uint8_t* p, size_t n);
+static crc32_update_fn crc32_update = crc32_update_resolve;
+
+static uint32_t crc32_update_resolve(uint32_t c, const uint8_t* p, size_t n) {
+    crc32_update_fn impl = crc32_update_table;
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (cpu_has_pclmul()) {
+        impl = crc32_update_pclmul;
+    }
+#endif
+    __atomic_store_n(&crc32_update, impl, __ATOMIC_RELAXED);
+    return impl(c, p, n);
+}
+
+uint32_t crc32(const void* data, size_t n) {
+    crc32_update_fn impl = __atomic_load_n(&crc32_update, __ATOMIC_RELAXED);
+    return impl(0xFFFFFFFFu, (const uint8_t*)data, n) ^ 0xFFFFFFFFu;
+}
+
+// Checksum functions
+uint32_t superblock_crc_finalize(superblock_t *sb) {
+    // The CRC covers the whole on-disk block, so stage the superblock in a
+    // zero-padded block instead of reading past the end of the struct
+    uint8_t block[BS];
+    sb->checksum = 0;
+    memset(block, 0, BS);
+    memcpy(block, sb, sizeof(superblock_t));
+    uint32_t s = crc32(block, BS - 4);
+    sb->checksum = s;
+    return s;
+}
+
+void group_desc_crc_finalize(group_desc_t* desc) {
+    desc->checksum = 0;
+    desc->checksum = crc32(desc, sizeof(group_desc_t) - 4);
+}
+
+void inode_crc_finalize(inode_t* ino) {
+    uint8_t tmp[INODE_SIZE];
+    memcpy(tmp, ino, INODE_SIZE);
+    // Zero CRC area before computing
+    memset(&tmp[120], 0, 8);
+    uint32_t c = crc32(tmp, 120);
+    ino->inode_crc = (uint64_t)c; // Low 4 bytes carry the CRC
+}
+
+void dirent_checksum_finalize(dirent64_t* de) {
+    const uint8_t* p = (const uint8_t*)de;
+    uint8_t x = 0;
+    for (int i = 0; i < 63; i++) {
+        x ^= p[i];   // Covers ino(4) + type(1) + name(58)
+    }
+    de->checksum = x;
+}
+
+// Image access functions
+static int image_map(fs_image_t* img, uint64_t total_blocks) {
+    img->total_blocks = total_blocks;
+    int prot = img->writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    void* base = mmap(NULL, (size_t)(total_blocks * BS), prot, MAP_SHARED, img->fd, 0);
+    if (base == MAP_FAILED) {
+        print_error("Cannot map image: %s", strerror(errno));
+        return -1;
+    }
+    img->base = (uint8_t*)base;
+    img->sb = (superblock_t*)img->base;
+    return 0;
+}
+
+// Write zeros over the whole image so every block is backed by storage
+static int image_zero_fill(int fd, uint64_t total_blocks) {
+    const uint64_t chunk_blocks = 256;
+    uint8_t* zeros = calloc(chunk_blocks, BS);
+    if (!zeros) {
+        print_error("Cannot allocate memory for zero fill");
+        return -1;
+    }
+    
+    for (uint64_t block = 0; block < total_blocks; block += chunk_blocks) {
+        uint64_t count = total_blocks - block < chunk_blocks ? total_blocks - block : chunk_blocks;
+        uint64_t done = 0;
+        while (done < count * BS) {
+            ssize_t n = pwrite(fd, zeros + done, (size_t)(count * BS - done), (off_t)(block * BS + done));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                free(zeros);
+                return -1;
+            }
+            done += (uint64_t)n;
+        }
+    }
+    
+    free(zeros);
+    return 0;
+}
+
+int image_create(fs_image_t* img, const char* path, uint64_t total_blocks, image_alloc_t alloc_mode) {
+    memset(img, 0, sizeof(fs_image_t));
+    img->writable = 1;
+    img->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (img->fd < 0) {
+        print_error("Cannot create image file %s: %s", path, strerror(errno));
+        return -1;
+    }
+    
+    // Size the file up front; untouched blocks read back as zeros
+    if (ftruncate(img->fd, (off_t)(total_blocks * BS)) != 0) {
+        print_error("Cannot size image file %s: %s", path, strerror(errno));
+        close(img->fd);
+        img->fd = -1;
+        return -1;
+    }
+    if (alloc_mode == IMAGE_ALLOC_ZERO_FILL && image_zero_fill(img->fd, total_blocks) != 0) {
+        print_error("Cannot write image file %s: %s", path, strerror(errno));
+        close(img->fd);
+        img->fd = -1;
+        return -1;
+    }
+    if (alloc_mode == IMAGE_ALLOC_PREALLOCATE) {
+        // Reserve the full extent without writing it; blocks still read as zeros
+        int err = posix_fallocate(img->fd, 0, (off_t)(total_blocks * BS));
+        if (err != 0) {
+            print_error("Cannot preallocate image file %s: %s", path, strerror(err));
+            close(img->fd);
+            img->fd = -1;
+            return -1;
+        }
+    }
+    
+    if (image_map(img, total_blocks) != 0) {
+        close(img->fd);
+        img->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int image_open(fs_image_t* img, const char* path, int writable) {
+    memset(img, 0, sizeof(fs_image_t));
+    img->writable = writable;
+    img->fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (img->fd < 0) {
+        print_error("Cannot open image %s: %s", path, strerror(errno));
+        return -1;
+    }
+    
+    // Read the superblock of the image
+    superblock_t sb;
+    if (pread(img->fd, &sb, sizeof(superblock_t), 0) != (ssize_t)sizeof(superblock_t)) {
+        print_error("Cannot read superblock");
+        close(img->fd);
+        img->fd = -1;
+        return -1;
+    }
+    
+    // Validate magic number and that the layout fits in the file
+    struct stat st;
+    if (sb.magic != MAGIC_NUMBER || sb.block_size != BS) {
+        print_error("Invalid file system magic number");
+        close(img->fd);
+        img->fd = -1;
+        return -1;
+    }
+    if (sb.version < 1 || sb.version > VERSION) {
+        print_error("Unsupported file system version %u", sb.version);
+        close(img->fd);
+        img->fd = -1;
+        return -1;
+    }
+    if (sb.flags & ~FS_FLAGS_SUPPORTED) {
+        print_error("Image %s uses unsupported features (flags 0x%x)", path, sb.flags);
+        close(img->fd);
+        img->fd = -1;
+        return -1;
+    }
+    // Extents and inline data reuse the block map area, which older
+    // versions always treat as block pointers
+    if ((sb.flags & (FS_FLAG_EXTENTS | FS_FLAG_INLINE_DATA)) && sb.version < 4) {
+        print_error("Image %s is version %u but uses features that need version 4 (flags 0x%x)", path,
+                    sb.version, sb.flags);
+        close(img->fd);
+        img->fd = -1;
+        return -1;
+    }
+    int layout_ok;
+    if (sb.flags & FS_FLAG_BLOCK_GROUPS) {
+        // Each group's regions are checked against its descriptor once mapped
+        uint64_t desc_blocks = ((uint64_t)sb.group_count * sizeof(group_desc_t) + BS - 1) / BS;
+        layout_ok = sb.version >= 5 && sb.group_count > 0 && sb.inodes_per_group > 0 &&
+                    sb.inodes_per_group <= BITS_PER_BLOCK &&
+                    (uint64_t)sb.group_count * sb.inodes_per_group == sb.inode_count &&
+                    1 + desc_blocks < sb.total_blocks;
+    } else {
+        layout_ok = sb.data_region_start + sb.data_region_blocks <= sb.total_blocks &&
+                    sb.inode_count <= UINT32_MAX && sb.data_region_blocks <= UINT32_MAX &&
+                    sb.inode_bitmap_blocks * BITS_PER_BLOCK >= sb.inode_count &&
+                    sb.data_bitmap_blocks * BITS_PER_BLOCK >= sb.data_region_blocks &&
+                    sb.inode_table_blocks * (BS / INODE_SIZE) >= sb.inode_count;
+    }
+    if (fstat(img->fd, &st) != 0 || (uint64_t)st.st_size < sb.total_blocks * BS || !layout_ok) {
+        print_error("Image %s is truncated or has an invalid layout", path);
+        close(img->fd);
+        img->fd = -1;
+        return -1;
+    }
+    
+    if (image_map(img, sb.total_blocks) != 0) {
+        close(img->fd);
+        img->fd = -1;
+        return -1;
+    }
+    if (image_attach_views(img) != 0) {
+        print_error("Image %s has an invalid block group layout", path);
+        image_close(img);
+        return -1;
+    }
+    
+    if (image_build_indexes(img) != 0) {
+        image_close(img);
+        return -1;
+    }
+    
+    // Version 1 superblocks have no allocation hints (their checksum sits
+    // where the hints are now), so start scanning from the beginning
+    if (sb.version >= 2) {
+        img->inode_alloc_hint = sb.inode_alloc_hint;
+        img->data_alloc_hint = sb.data_alloc_hint;
+    }
+    return 0;
+}
+
+// Point the typed views at the regions described by the superblock, or by
+// the group descriptors on a grouped image; a flat image is one group
+int image_attach_views(fs_image_t* img) {
+    superblock_t* sb = img->sb;
+    int grouped = (sb->flags & FS_FLAG_BLOCK_GROUPS) != 0;
+    uint32_t group_count = grouped ? sb->group_count : 1;
+    free(img->groups);
+    img->groups = calloc(group_count, sizeof(fs_group_t));
+    if (!img->groups) {
+        print_error("Cannot allocate memory for block groups");
+        return -1;
+    }
+    img->group_count = group_count;
+    img->inodes_per_group = grouped ? sb->inodes_per_group : (uint32_t)sb->inode_count;
+    
+    uint32_t data_base = 0;
+    for (uint32_t g = 0; g < group_count; g++) {
+        fs_group_t* group = &img->groups[g];
+        if (grouped) {
+            const group_desc_t* desc = image_group_desc(img, g);
+            group->inode_bitmap_start = desc->inode_bitmap_start;
+            group->data_bitmap_start = desc->data_bitmap_start;
+            group->inode_table_start = desc->inode_table_start;
+            group->data_region_start = desc->data_region_start;
+            group->data_region_blocks = desc->data_region_blocks;
+            uint64_t table_blocks = ((uint64_t)img->inodes_per_group * INODE_SIZE + BS - 1) / BS;
+            if (desc->inode_bitmap_start >= img->total_blocks ||
+                desc->data_bitmap_start >= img->total_blocks ||
+                desc->inode_table_start + table_blocks > img->total_blocks ||
+                desc->data_region_start + desc->data_region_blocks > img->total_blocks ||
+                desc->data_region_blocks > BITS_PER_BLOCK) {
+                return -1;
+            }
+        } else {
+            group->inode_bitmap_start = sb->inode_bitmap_start;
+            group->data_bitmap_start = sb->data_bitmap_start;
+            group->inode_table_start = sb->inode_table_start;
+            group->data_region_start = sb->data_region_start;
+            group->data_region_blocks = (uint32_t)sb->data_region_blocks;
+        }
+        group->first_inode = g * img->inodes_per_group + 1;
+        group->inode_count = img->inodes_per_group;
+        group->data_base = data_base;
+        data_base += group->data_region_blocks;
+        group->inode_bitmap = image_block(img, group->inode_bitmap_start);
+        group->data_bitmap = image_block(img, group->data_bitmap_start);
+        group->inode_table = (inode_t*)image_block(img, group->inode_table_start);
+    }
+    return 0;
+}
+
+// Build the in-memory free-space indexes over each group's bitmaps; the
+// allocation functions need them
+int image_build_indexes(fs_image_t* img) {
+    for (uint32_t g = 0; g < img->group_count; g++) {
+        fs_group_t* group = &img->groups[g];
+        if (bitmap_index_build(&group->inode_index, group->inode_bitmap, group->inode_count) != 0 ||
+            bitmap_index_build(&group->data_index, group->data_bitmap, group->data_region_blocks) != 0 ||
+            free_extents_build(&group->data_extents, group->data_bitmap, group->data_region_blocks) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Refresh the free counts and checksums of the group descriptors
+void image_update_group_descs(fs_image_t* img) {
+    if (!(img->sb->flags & FS_FLAG_BLOCK_GROUPS)) {
+        return;
+    }
+    for (uint32_t g = 0; g < img->group_count; g++) {
+        fs_group_t* group = &img->groups[g];
+        group_desc_t* desc = image_group_desc(img, g);
+        desc->free_inodes = (uint32_t)count_free_bits(group->inode_bitmap, group->inode_count);
+        desc->free_data_blocks = (uint32_t)count_free_bits(group->data_bitmap, group->data_region_blocks);
+        group_desc_crc_finalize(desc);
+    }
+    image_mark_dirty(img, 1, ((uint64_t)img->group_count * sizeof(group_desc_t) + BS - 1) / BS);
+}
+
+// Stamp the superblock for a commit: store the allocation hints, upgrade
+// older images to the current version and refresh mtime and checksum
+void image_update_superblock(fs_image_t* img, time_t now) {
+    if (!(img->sb->flags & FS_FLAG_BLOCK_GROUPS)) {
+        // Older versions kept their checksum where the group fields are now
+        img->sb->group_count = 0;
+        img->sb->blocks_per_group = 0;
+        img->sb->inodes_per_group = 0;
+    }
+    image_update_group_descs(img);
+    img->sb->version = VERSION;
+    img->sb->inode_alloc_hint = img->inode_alloc_hint;
+    img->sb->data_alloc_hint = img->data_alloc_hint;
+    img->sb->mtime_epoch = (uint64_t)now;
+    superblock_crc_finalize(img->sb);
+    image_mark_dirty(img, 0, 1);
+}
+
+uint8_t* image_block(fs_image_t* img, uint64_t block_no) {
+    return img->base + block_no * BS;
+}
+
+group_desc_t* image_group_desc(fs_image_t* img, uint32_t group) {
+    return (group_desc_t*)image_block(img, 1) + group;
+}
+
+inode_t* image_inode(fs_image_t* img, uint32_t inode_num) {
+    uint32_t index = inode_num - 1;  // Inodes are 1-indexed
+    return &img->groups[index / img->inodes_per_group].inode_table[index % img->inodes_per_group];
+}
+
+uint32_t image_inode_group(const fs_image_t* img, uint32_t inode_num) {
+    return (inode_num - 1) / img->inodes_per_group;
+}
+
+int image_mark_dirty(fs_image_t* img, uint64_t first_block, uint64_t block_count) {
+    // Extend the previous range when blocks are dirtied in order
+    if (img->dirty_count > 0) {
+        dirty_range_t* last = &img->dirty[img->dirty_count - 1];
+        if (first_block >= last->first_block &&
+            first_block <= last->first_block + last->block_count) {
+            uint64_t end = first_block + block_count;
+            if (end > last->first_block + last->block_count) {
+                last->block_count = end - last->first_block;
+            }
+            return 0;
+        }
+    }
+    
+    if (img->dirty_count == img->dirty_capacity) {
+        size_t new_capacity = img->dirty_capacity ? img->dirty_capacity * 2 : 16;
+        dirty_range_t* grown = realloc(img->dirty, new_capacity * sizeof(dirty_range_t));
+        if (!grown) {
+            print_error("Cannot allocate memory for dirty block list");
+            return -1;
+        }
+        img->dirty = grown;
+        img->dirty_capacity = new_capacity;
+    }
+    img->dirty[img->dirty_count].first_block = first_block;
+    img->dirty[img->dirty_count].block_count = block_count;
+    img->dirty_count++;
+    return 0;
+}
+
+int image_mark_inode_dirty(fs_image_t* img, uint32_t inode_num) {
+    uint32_t inodes_per_block = BS / INODE_SIZE;
+    uint32_t index = inode_num - 1;
+    const fs_group_t* group = &img->groups[index / img->inodes_per_group];
+    return image_mark_dirty(img, group->inode_table_start +
+                            (index % img->inodes_per_group) / inodes_per_block, 1);
+}
+
+static int compare_dirty_ranges(const void* a, const void* b) {
+    const dirty_range_t* ra = (const dirty_range_t*)a;
+    const dirty_range_t* rb = (const dirty_range_t*)b;
+    return (ra->first_block > rb->first_block) - (ra->first_block < rb->first_block);
+}
+
+// Write back only the dirty ranges, merged and in block order
+int image_flush(fs_image_t* img) {
+    qsort(img->dirty, img->dirty_count, sizeof(dirty_range_t), compare_dirty_ranges);
+    
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t i = 0;
+    while (i < img->dirty_count) {
+        uint64_t start = img->dirty[i].first_block;
+        uint64_t end = start + img->dirty[i].block_count;
+        for (i++; i < img->dirty_count && img->dirty[i].first_block <= end; i++) {
+            uint64_t range_end = img->dirty[i].first_block + img->dirty[i].block_count;
+            if (range_end > end) {
+                end = range_end;
+            }
+        }
+        
+        // msync needs a page-aligned address
+        uint64_t offset = start * BS;
+        uint64_t aligned = offset - offset % (uint64_t)page_size;
+        if (msync(img->base + aligned, (size_t)(end * BS - aligned), MS_SYNC) != 0) {
+            print_error("Cannot write back image blocks: %s", strerror(errno));
+            return -1;
+        }
+    }
+    
+    img->dirty_count = 0;
+    return 0;
+}
+
+int image_close(fs_image_t* img) {
+    int rc = 0;
+    if (img->writable && img->base && image_flush(img) != 0) {
+        rc = -1;
+    }
+    if (img->base && munmap(img->base, (size_t)(img->total_blocks * BS)) != 0) {
+        rc = -1;
+    }
+    if (img->fd >= 0 && close(img->fd) != 0) {
+        print_error("Cannot close image: %s", strerror(errno));
+        rc = -1;
+    }
+    free(img->dirty);
+    for (uint32_t g = 0; g < img->group_count; g++) {
+        bitmap_index_free(&img->groups[g].inode_index);
+        bitmap_index_free(&img->groups[g].data_index);
+        free_extents_free(&img->groups[g].data_extents);
+    }
+    free(img->groups);
+    memset(img, 0, sizeof(fs_image_t));
+    img->fd = -1;
+    return rc;
+}
+
+// Allocation functions. Inodes and data blocks are taken from a preferred
+// group first; the bitmaps, their in-memory indexes and the dirty ranges
+// are updated together.
+// Mark the bitmap blocks holding bits [first, first + count) dirty
+static void mark_bitmap_dirty(fs_image_t* img, uint64_t bitmap_start, uint32_t first, uint32_t count) {
+    uint64_t first_block = first / BITS_PER_BLOCK;
+    uint64_t last_block = (first + (uint64_t)count - 1) / BITS_PER_BLOCK;
+    image_mark_dirty(img, bitmap_start + first_block, last_block - first_block + 1);
+}
+
+uint32_t image_alloc_inode(fs_image_t* img, uint32_t preferred_group) {
+    for (uint32_t i = 0; i < img->group_count; i++) {
+        fs_group_t* group = &img->groups[(preferred_group + i) % img->group_count];
+        
+        // Resume after the last inode handed out when it is in this group
+        uint32_t start = 0;
+        uint32_t first_bit = group->first_inode - 1;
+        if (img->inode_alloc_hint >= first_bit && img->inode_alloc_hint - first_bit < group->inode_count) {
+            start = img->inode_alloc_hint - first_bit;
+        }
+        int bit = bitmap_index_find_free(&group->inode_index, start);
+        if (bit < 0) {
+            continue;
+        }
+        bitmap_index_set_range(&group->inode_index, (uint32_t)bit, 1);
+        mark_bitmap_dirty(img, group->inode_bitmap_start, (uint32_t)bit, 1);
+        uint32_t inode_num = group->first_inode + (uint32_t)bit;
+        img->inode_alloc_hint = inode_num;  // Bit of the next inode
+        return inode_num;
+    }
+    return 0;
+}
+
+void image_free_inode(fs_image_t* img, uint32_t inode_num) {
+    fs_group_t* group = &img->groups[image_inode_group(img, inode_num)];
+    uint32_t bit = inode_num - group->first_inode;
+    bitmap_index_clear_range(&group->inode_index, bit, 1);
+    mark_bitmap_dirty(img, group->inode_bitmap_start, bit, 1);
+}
+
+// Group whose data region holds an absolute block, or NULL
+static fs_group_t* image_block_group(fs_image_t* img, uint64_t block_no) {
+    uint32_t lo = 0;
+    uint32_t hi = img->group_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (img->groups[mid].data_region_start <= block_no) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return NULL;
+    }
+    fs_group_t* group = &img->groups[lo - 1];
+    return block_no < group->data_region_start + group->data_region_blocks ? group : NULL;
+}
+
+// Take count blocks from one group, returning absolute extents
+static int group_alloc_blocks(fs_image_t* img, fs_group_t* group, uint32_t count,
+                              extent_t* extents, int max_extents) {
+    // Next-fit among equally good runs, from the last block handed out
+    uint32_t hint = 0;
+    if (img->data_alloc_hint >= group->data_base &&
+        img->data_alloc_hint - group->data_base < group->data_region_blocks) {
+        hint = img->data_alloc_hint - group->data_base;
+    }
+    int extent_count = free_extents_alloc(&group->data_extents, count, extents, max_extents, hint);
+    for (int i = 0; i < extent_count; i++) {
+        bitmap_index_set_range(&group->data_index, extents[i].start, extents[i].length);
+        mark_bitmap_dirty(img, group->data_bitmap_start, extents[i].start, extents[i].length);
+        img->data_alloc_hint = group->data_base + extents[i].start + extents[i].length;
+        extents[i].start += (uint32_t)group->data_region_start;
+    }
+    return extent_count;
+}
+
+int image_alloc_blocks(fs_image_t* img, uint32_t preferred_group, uint64_t count,
+                       extent_t* extents, int max_extents) {
+    if (count == 0) {
+        return 0;
+    }
+    if (count > UINT32_MAX) {
+        return -1;
+    }
+    
+    // Prefer a group with one free run that holds everything, then a group
+    // with enough free blocks in total, looking from the preferred group on
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t i = 0; i < img->group_count; i++) {
+            fs_group_t* group = &img->groups[(preferred_group + i) % img->group_count];
+            int fits = pass == 0 ? free_extents_largest(&group->data_extents) >= count :
+                                   group->data_extents.free_blocks >= count;
+            if (fits) {
+                int extent_count = group_alloc_blocks(img, group, (uint32_t)count, extents, max_extents);
+                if (extent_count > 0) {
+                    return extent_count;
+                }
+            }
+        }
+    }
+    
+    // Otherwise spread the blocks over as many groups as it takes
+    int extent_count = 0;
+    uint64_t remaining = count;
+    for (uint32_t i = 0; i < img->group_count && remaining > 0; i++) {
+        fs_group_t* group = &img->groups[(preferred_group + i) % img->group_count];
+        uint64_t take = group->data_extents.free_blocks < remaining ?
+            group->data_extents.free_blocks : remaining;
+        if (take == 0) {
+            continue;
+        }
+        int taken = group_alloc_blocks(img, group, (uint32_t)take, extents + extent_count,
+                                       max_extents - extent_count);
+        if (taken < 0) {
+            break;
+        }
+        extent_count += taken;
+        remaining -= take;
+    }
+    if (remaining > 0) {
+        for (int i = 0; i < extent_count; i++) {
+            image_free_blocks(img, extents[i].start, extents[i].length);
+        }
+        return -1;
+    }
+    return extent_count;
+}
+
+void image_free_blocks(fs_image_t* img, uint64_t first_block, uint32_t block_count) {
+    fs_group_t* group = image_block_group(img, first_block);
+    if (!group || block_count == 0) {
+        return;
+    }
+    uint32_t bit = (uint32_t)(first_block - group->data_region_start);
+    bitmap_index_clear_range(&group->data_index, bit, block_count);
+    free_extents_release(&group->data_extents, bit, block_count);
+    mark_bitmap_dirty(img, group->data_bitmap_start, bit, block_count);
+}
+
+// Group for a new directory: the one with the most free inodes, so
+// directories, and the files placed next to them, spread over the image.
+// Ties go to the parent's group.
+uint32_t image_dir_group(const fs_image_t* img, uint32_t parent_group) {
+    uint32_t best = parent_group;
+    uint64_t best_free = count_free_bits(img->groups[parent_group].inode_bitmap,
+                                         img->groups[parent_group].inode_count);
+    for (uint32_t g = 0; g < img->group_count; g++) {
+        uint64_t free_inodes = count_free_bits(img->groups[g].inode_bitmap, img->groups[g].inode_count);
+        if (free_inodes > best_free) {
+            best = g;
+            best_free = free_inodes;
+        }
+    }
+    return best;
+}
+
+uint64_t image_free_inode_count(const fs_image_t* img) {
+    uint64_t free_inodes = 0;
+    for (uint32_t g = 0; g < img->group_count; g++) {
+        free_inodes += count_free_bits(img->groups[g].inode_bitmap, img->groups[g].inode_count);
+    }
+    return free_inodes;
+}
+
+uint64_t image_free_block_count(const fs_image_t* img) {
+    uint64_t free_blocks = 0;
+    for (uint32_t g = 0; g < img->group_count; g++) {
+        free_blocks += img->groups[g].data_extents.free_blocks;
+    }
+    return free_blocks;
+}
+
+uint64_t image_free_extent_count(const fs_image_t* img) {
+    uint64_t extent_count = 0;
+    for (uint32_t g = 0; g < img->group_count; g++) {
+        extent_count += img->groups[g].data_extents.count;
+    }
+    return extent_count;
+}
+
+uint32_t image_largest_free_extent(const fs_image_t* img) {
+    uint32_t largest = 0;
+    for (uint32_t g = 0; g < img->group_count; g++) {
+        uint32_t group_largest = free_extents_largest(&img->groups[g].data_extents);
+        if (group_largest > largest) {
+            largest = group_largest;
+        }
+    }
+    return largest;
+}
+
+// Whether a file's contents are stored in the inode instead of data blocks.
+// There is no per-inode flag: on inline-data images every regular file of
+// at most INLINE_DATA_MAX bytes is inline.
+int inode_is_inline(const fs_image_t* img, const inode_t* inode) {
+    return (img->sb->flags & FS_FLAG_INLINE_DATA) && inode->mode == MODE_FILE &&
+           inode->size_bytes <= INLINE_DATA_MAX;
+}
+
+// Inode block map functions. Blocks 0..11 of a file are in direct[];
+// the next PTRS_PER_BLOCK come from the single-indirect block and the rest
+// from the double-indirect block, which points at further indirect blocks.
+// Pointers are absolute block numbers, 0 meaning unmapped.
+uint64_t inode_map_blocks(uint64_t block_count) {
+    if (block_count <= DIRECT_MAX) {
+        return 0;
+    }
+    if (block_count <= DIRECT_MAX + PTRS_PER_BLOCK) {
+        return 1;
+    }
+    uint64_t double_blocks = block_count - DIRECT_MAX - PTRS_PER_BLOCK;
+    return 2 + (double_blocks + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK;
+}
+
+// Follow one level of indirection, refusing pointers outside the image
+static uint32_t indirect_entry(fs_image_t* img, uint32_t block_no, uint64_t index) {
+    if (block_no == 0 || block_no >= img->total_blocks) {
+        return 0;
+    }
+    const uint32_t* pointers = (const uint32_t*)image_block(img, block_no);
+    return pointers[index];
+}
+
+uint32_t inode_block_at(fs_image_t* img, const inode_t* inode, uint64_t file_block) {
+    if (inode_is_inline(img, inode)) {
+        return 0;
+    }
+    if (img->sb->flags & FS_FLAG_EXTENTS) {
+        const extent_t* extent;
+        for (uint32_t i = 0; (extent = inode_extent(img, inode, i)) != NULL; i++) {
+            if (file_block < extent->length) {
+                return extent->start + (uint32_t)file_block;
+            }
+            file_block -= extent->length;
+        }
+        return 0;
+    }
+    if (file_block < DIRECT_MAX) {
+        return inode->direct[file_block];
+    }
+    file_block -= DIRECT_MAX;
+    if (file_block < PTRS_PER_BLOCK) {
+        return indirect_entry(img, inode->indirect, file_block);
+    }
+    file_block -= PTRS_PER_BLOCK;
+    if (file_block >= (uint64_t)PTRS_PER_BLOCK * PTRS_PER_BLOCK) {
+        return 0;
+    }
+    uint32_t second = indirect_entry(img, inode->double_indirect, file_block / PTRS_PER_BLOCK);
+    return indirect_entry(img, second, file_block % PTRS_PER_BLOCK);
+}
+
+// Take the next block from the allocation order and clear it as a fresh
+// pointer block
+static uint32_t* claim_pointer_block(fs_image_t* img, const uint32_t* blocks, uint64_t* next,
+                                     uint32_t* block_no) {
+    *block_no = blocks[(*next)++];
+    uint32_t* pointers = (uint32_t*)image_block(img, *block_no);
+    memset(pointers, 0, BS);
+    image_mark_dirty(img, *block_no, 1);
+    return pointers;
+}
+
+// Point an inode at block_count data blocks. blocks holds the data and
+// pointer blocks together (block_count + inode_map_blocks(block_count)
+// entries) in allocation order; data_blocks receives the data blocks in
+// file order.
+void inode_set_blocks(fs_image_t* img, inode_t* inode, const uint32_t* blocks,
+                      uint64_t block_count, uint32_t* data_blocks) {
+    uint64_t next = 0;
+    uint32_t* pointers = NULL;
+    uint32_t* second_level = NULL;
+    
+    // Each pointer block comes right before the data it maps, so a
+    // contiguous allocation reads sequentially
+    for (uint64_t file_block = 0; file_block < block_count; file_block++) {
+        if (file_block < DIRECT_MAX) {
+            inode->direct[file_block] = blocks[next];
+        } else if (file_block < DIRECT_MAX + PTRS_PER_BLOCK) {
+            uint64_t index = file_block - DIRECT_MAX;
+            if (index == 0) {
+                pointers = claim_pointer_block(img, blocks, &next, &inode->indirect);
+            }
+            pointers[index] = blocks[next];
+        } else {
+            uint64_t index = file_block - DIRECT_MAX - PTRS_PER_BLOCK;
+            if (index == 0) {
+                second_level = claim_pointer_block(img, blocks, &next, &inode->double_indirect);
+            }
+            if (index % PTRS_PER_BLOCK == 0) {
+                pointers = claim_pointer_block(img, blocks, &next,
+                                               &second_level[index / PTRS_PER_BLOCK]);
+            }
+            pointers[index % PTRS_PER_BLOCK] = blocks[next];
+        }
+        data_blocks[file_block] = blocks[next++];
+    }
+}
+
+// Extent of an extent-mapped inode: the first INODE_EXTENTS live in the
+// inode, the rest in the overflow block named by inode->indirect. Returns
+// NULL past the last extent.
+const extent_t* inode_extent(fs_image_t* img, const inode_t* inode, uint32_t index) {
+    const extent_t* extent;
+    if (index < INODE_EXTENTS) {
+        extent = &inode->extents[index];
+    } else {
+        index -= INODE_EXTENTS;
+        if (index >= EXTENTS_PER_BLOCK || inode->indirect == 0 ||
+            inode->indirect >= img->total_blocks) {
+            return NULL;
+        }
+        extent = (const extent_t*)image_block(img, inode->indirect) + index;
+    }
+    return extent->length > 0 ? extent : NULL;
+}
+
+// Store a file's absolute extents in an inode, spilling past INODE_EXTENTS
+// into overflow_block (unused and may be 0 when the extents fit inline)
+void inode_set_extents(fs_image_t* img, inode_t* inode, const extent_t* extents,
+                       uint32_t extent_count, uint32_t overflow_block) {
+    memset(inode->extents, 0, sizeof(inode->extents));
+    inode->indirect = 0;
+    inode->double_indirect = 0;
+    for (uint32_t i = 0; i < extent_count && i < INODE_EXTENTS; i++) {
+        inode->extents[i] = extents[i];
+    }
+    if (extent_count > INODE_EXTENTS) {
+        extent_t* overflow = (extent_t*)image_block(img, overflow_block);
+        memset(overflow, 0, BS);
+        memcpy(overflow, extents + INODE_EXTENTS, (extent_count - INODE_EXTENTS) * sizeof(extent_t));
+        inode->indirect = overflow_block;
+        image_mark_dirty(img, overflow_block, 1);
+    }
+}
+
+// Extent slot of an extent-mapped inode, inline or in the overflow block
+static extent_t* inode_extent_slot(fs_image_t* img, inode_t* inode, uint32_t index) {
+    if (index < INODE_EXTENTS) {
+        return &inode->extents[index];
+    }
+    return (extent_t*)image_block(img, inode->indirect) + (index - INODE_EXTENTS);
+}
+
+// Extent-mapped half of inode_append_blocks: take one free run of up to
+// count blocks, growing the last extent when the run follows it and
+// starting a new extent otherwise
+static uint32_t inode_append_extent_run(fs_image_t* img, inode_t* inode, uint32_t count,
+                                        uint32_t preferred_group, uint32_t* appended) {
+    uint32_t extent_count = 0;
+    while (inode_extent(img, inode, extent_count) != NULL) {
+        extent_count++;
+    }
+    
+    extent_t taken[2];
+    if (image_alloc_blocks(img, preferred_group, count, &taken[0], 1) != 1) {
+        count = 1;
+        if (image_alloc_blocks(img, preferred_group, 1, &taken[0], 1) != 1) {
+            return 0;
+        }
+    }
+    uint32_t block_no = taken[0].start;
+    uint32_t slot = extent_count - 1;
+    extent_t* last = extent_count > 0 ? inode_extent_slot(img, inode, slot) : NULL;
+    if (last && last->start + last->length == block_no && last->length <= UINT32_MAX - count) {
+        last->length += count;
+    } else if (extent_count < INODE_EXTENTS + EXTENTS_PER_BLOCK) {
+        if (extent_count == INODE_EXTENTS) {
+            // First extent past the inode: the overflow block comes with it
+            if (image_alloc_blocks(img, preferred_group, 1, &taken[1], 1) != 1) {
+                image_free_blocks(img, block_no, count);
+                return 0;
+            }
+            inode->indirect = taken[1].start;
+            memset(image_block(img, inode->indirect), 0, BS);
+        }
+        slot = extent_count;
+        last = inode_extent_slot(img, inode, slot);
+        last->start = block_no;
+        last->length = count;
+    } else {
+        image_free_blocks(img, block_no, count);
+        return 0;
+    }
+    if (slot >= INODE_EXTENTS) {
+        image_mark_dirty(img, inode->indirect, 1);
+    }
+    *appended = count;
+    return block_no;
+}
+
+// Append data blocks to an inode from file block file_block (its current
+// block count) on, allocating any pointer or overflow block that needs
+// from the preferred group. Extent-mapped inodes get one free run of up to
+// count blocks, others exactly one block; *appended receives the number.
+// The new blocks are zeroed and marked dirty; the caller stores and
+// checksums the inode. Returns the first new block, or 0 if the image is
+// full or the block map cannot grow any further.
+uint32_t inode_append_blocks(fs_image_t* img, inode_t* inode, uint64_t file_block, uint32_t count,
+                             uint32_t preferred_group, uint32_t* appended) {
+    uint32_t block_no;
+    *appended = 1;
+    if (img->sb->flags & FS_FLAG_EXTENTS) {
+        block_no = inode_append_extent_run(img, inode, count, preferred_group, appended);
+    } else {
+        if (file_block >= FILE_MAX_BLOCKS) {
+            return 0;
+        }
+        
+        // Pointer blocks start where inode_set_blocks would start them
+        uint64_t index = 0;
+        uint32_t map_count = file_block == DIRECT_MAX ? 1 : 0;
+        if (file_block >= DIRECT_MAX + PTRS_PER_BLOCK) {
+            index = file_block - DIRECT_MAX - PTRS_PER_BLOCK;
+            map_count = (index == 0) + (index % PTRS_PER_BLOCK == 0);
+        }
+        extent_t taken[3];
+        int extent_count = image_alloc_blocks(img, preferred_group, map_count + 1, taken, 3);
+        if (extent_count < 0) {
+            return 0;
+        }
+        uint32_t blocks[3];
+        uint64_t next = 0;
+        for (int e = 0; e < extent_count; e++) {
+            for (uint32_t i = 0; i < taken[e].length; i++) {
+                blocks[next++] = taken[e].start + i;
+            }
+        }
+        
+        next = 0;
+        if (file_block < DIRECT_MAX) {
+            inode->direct[file_block] = blocks[next];
+        } else if (file_block < DIRECT_MAX + PTRS_PER_BLOCK) {
+            uint32_t* pointers = file_block == DIRECT_MAX ?
+                claim_pointer_block(img, blocks, &next, &inode->indirect) :
+                (uint32_t*)image_block(img, inode->indirect);
+            pointers[file_block - DIRECT_MAX] = blocks[next];
+            image_mark_dirty(img, inode->indirect, 1);
+        } else {
+            uint32_t* second_level = index == 0 ?
+                claim_pointer_block(img, blocks, &next, &inode->double_indirect) :
+                (uint32_t*)image_block(img, inode->double_indirect);
+            uint32_t* slot = &second_level[index / PTRS_PER_BLOCK];
+            uint32_t* pointers = index % PTRS_PER_BLOCK == 0 ?
+                claim_pointer_block(img, blocks, &next, slot) :
+                (uint32_t*)image_block(img, *slot);
+            pointers[index % PTRS_PER_BLOCK] = blocks[next];
+            image_mark_dirty(img, inode->double_indirect, 1);
+            image_mark_dirty(img, *slot, 1);
+        }
+        block_no = blocks[next];
+    }
+    if (block_no != 0) {
+        memset(image_block(img, block_no), 0, (size_t)*appended * BS);
+        image_mark_dirty(img, block_no, *appended);
+    }
+    return block_no;
+}
+
+// Directory functions. A directory is an array of dirent64_t over its data
+// blocks, in block map order; block 0 starts with "." and "..". Entries are
+// never removed, so free slots are all at the end, and a directory grows
+// when it is full. Indexed directories (see
+// dir_index_header_t) keep their entries in hash-ordered leaf blocks
+// instead.
+uint64_t dir_block_count(fs_image_t* img, const inode_t* dir) {
+    uint64_t count = 0;
+    while (count < FILE_MAX_BLOCKS && inode_block_at(img, dir, count) != 0) {
+        count++;
+    }
+    return count;
+}
+
+// Hash that orders names in the directory index
+uint32_t dir_name_hash(const char* name) {
+    return crc32(name, strlen(name));
+}
+
+static dir_index_entry_t* dir_index_entries(dir_index_header_t* node) {
+    return (dir_index_entry_t*)(node + 1);
+}
+
+// Clear an index node of the given size in bytes and set its header
+static void dir_index_node_init(dir_index_header_t* node, uint8_t levels, size_t node_bytes) {
+    memset(node, 0, node_bytes);
+    node->magic = DIR_INDEX_MAGIC;
+    node->levels = levels;
+    node->limit = (uint16_t)((node_bytes - sizeof(dir_index_header_t)) / sizeof(dir_index_entry_t));
+}
+
+// Start an empty index in block 0 of a new directory, after "." and ".."
+void dir_index_init(uint8_t* dir_block) {
+    dir_index_header_t* root = (dir_index_header_t*)(dir_block + DIR_INDEX_ROOT_OFFSET);
+    dir_index_node_init(root, 0, BS - DIR_INDEX_ROOT_OFFSET);
+    root->blocks_used = 1;
+}
+
+static dir_index_header_t* dir_index_root(fs_image_t* img, const inode_t* dir, uint32_t* block_no) {
+    *block_no = inode_block_at(img, dir, 0);
+    if (*block_no == 0) {
+        return NULL;
+    }
+    return (dir_index_header_t*)(image_block(img, *block_no) + DIR_INDEX_ROOT_OFFSET);
+}
+
+int dir_is_indexed(fs_image_t* img, const inode_t* dir) {
+    if (!(img->sb->flags & FS_FLAG_DIR_INDEX)) {
+        return 0;
+    }
+    uint32_t block_no;
+    const dir_index_header_t* root = dir_index_root(img, dir, &block_no);
+    return root && root->magic == DIR_INDEX_MAGIC && root->levels <= DIR_INDEX_LEVELS_MAX &&
+           root->blocks_used > 0;
+}
+
+// Nodes from the index root down to the leaf that covers one hash
+typedef struct {
+    dir_index_header_t* node[DIR_INDEX_LEVELS_MAX + 1];
+    uint32_t node_block[DIR_INDEX_LEVELS_MAX + 1];  // Absolute block of each node
+    uint16_t slot[DIR_INDEX_LEVELS_MAX + 1];        // Entry followed in each node
+    int depth;                                      // Nodes in the path
+    uint32_t leaf_block;                            // Absolute block of the leaf
+} dir_index_path_t;
+
+// Last entry of a node whose hash is <= hash; entry 0 covers every hash
+// below entry 1
+static uint16_t dir_index_search(dir_index_header_t* node, uint32_t hash) {
+    const dir_index_entry_t* entries = dir_index_entries(node);
+    uint16_t lo = 1;
+    uint16_t hi = node->count;
+    while (lo < hi) {
+        uint16_t mid = (uint16_t)((lo + hi) / 2);
+        if (entries[mid].hash <= hash) {
+            lo = (uint16_t)(mid + 1);
+        } else {
+            hi = mid;
+        }
+    }
+    return (uint16_t)(lo - 1);
+}
+
+// Follow the index to the leaf for a hash. Returns -1 if the index is
+// empty or damaged.
+static int dir_index_walk(fs_image_t* img, const inode_t* dir, uint32_t hash, dir_index_path_t* path) {
+    uint32_t block_no;
+    dir_index_header_t* node = dir_index_root(img, dir, &block_no);
+    uint8_t levels = node->levels;
+    for (int depth = 0; depth <= levels; depth++) {
+        if (node->magic != DIR_INDEX_MAGIC || node->count == 0 || node->count > node->limit) {
+            return -1;
+        }
+        path->node[depth] = node;
+        path->node_block[depth] = block_no;
+        path->slot[depth] = dir_index_search(node, hash);
+        block_no = inode_block_at(img, dir, dir_index_entries(node)[path->slot[depth]].block);
+        if (block_no == 0) {
+            return -1;
+        }
+        node = (dir_index_header_t*)image_block(img, block_no);
+    }
+    path->depth = levels + 1;
+    path->leaf_block = block_no;
+    return 0;
+}
+
+// Put a child entry into an index node right after slot
+static void dir_index_insert(dir_index_header_t* node, uint16_t slot, uint32_t hash, uint32_t block) {
+    dir_index_entry_t* entries = dir_index_entries(node);
+    memmove(&entries[slot + 2], &entries[slot + 1], (node->count - slot - 1) * sizeof(dir_index_entry_t));
+    entries[slot + 1].hash = hash;
+    entries[slot + 1].block = block;
+    node->count++;
+}
+
+// Append blocks to a directory that has block_count of them.
+// Extent-mapped directories grow by a run as long as they already are, up
+// to DIR_PREALLOC_MAX blocks, so a large directory stays in few extents
+// even when files are allocated in between; the extra blocks start out
+// empty. Returns the first new block, or 0.
+static uint32_t dir_grow(fs_image_t* img, uint32_t dir_ino, inode_t* dir, uint64_t block_count) {
+    uint32_t count = block_count < DIR_PREALLOC_MAX ? (uint32_t)block_count : DIR_PREALLOC_MAX;
+    uint32_t appended;
+    return inode_append_blocks(img, dir, block_count, count > 0 ? count : 1,
+                               image_inode_group(img, dir_ino), &appended);
+}
+
+// Next unused block of an indexed directory, growing it when no spare
+// block is left. Returns the absolute block number and the directory
+// block number in *dir_block, or 0.
+static uint32_t dir_index_append(fs_image_t* img, uint32_t dir_ino, inode_t* dir, uint32_t* dir_block) {
+    uint32_t root_block;
+    dir_index_header_t* root = dir_index_root(img, dir, &root_block);
+    *dir_block = root->blocks_used;
+    uint32_t block_no = inode_block_at(img, dir, root->blocks_used);
+    if (block_no == 0) {
+        block_no = dir_grow(img, dir_ino, dir, root->blocks_used);
+        if (block_no == 0) {
+            return 0;
+        }
+    }
+    root->blocks_used++;
+    image_mark_dirty(img, root_block, 1);
+    return block_no;
+}
+
+// Make room in the node above a full leaf: a full root moves its entries
+// into a new node one level down, and a full node gives half its entries
+// to a new sibling
+static int dir_index_grow(fs_image_t* img, uint32_t dir_ino, inode_t* dir, dir_index_path_t* path) {
+    dir_index_header_t* root = path->node[0];
+    uint32_t dir_block;
+    if (root->levels == 0) {
+        uint32_t block_no = dir_index_append(img, dir_ino, dir, &dir_block);
+        if (block_no == 0) {
+            return -1;
+        }
+        dir_index_header_t* node = (dir_index_header_t*)image_block(img, block_no);
+        dir_index_node_init(node, 0, BS);
+        memcpy(dir_index_entries(node), dir_index_entries(root), root->count * sizeof(dir_index_entry_t));
+        node->count = root->count;
+        
+        memset(dir_index_entries(root), 0, root->count * sizeof(dir_index_entry_t));
+        root->levels = 1;
+        root->count = 1;
+        dir_index_entries(root)[0].hash = 0;
+        dir_index_entries(root)[0].block = dir_block;
+        image_mark_dirty(img, path->node_block[0], 1);
+        return 0;
+    }
+    
+    if (root->count == root->limit) {
+        return -1;  // Both levels full
+    }
+    dir_index_header_t* full = path->node[1];
+    uint32_t block_no = dir_index_append(img, dir_ino, dir, &dir_block);
+    if (block_no == 0) {
+        return -1;
+    }
+    dir_index_header_t* sibling = (dir_index_header_t*)image_block(img, block_no);
+    dir_index_node_init(sibling, 0, BS);
+    uint16_t half = full->count / 2;
+    sibling->count = (uint16_t)(full->count - half);
+    memcpy(dir_index_entries(sibling), &dir_index_entries(full)[half],
+           sibling->count * sizeof(dir_index_entry_t));
+    memset(&dir_index_entries(full)[half], 0, sibling->count * sizeof(dir_index_entry_t));
+    full->count = half;
+    dir_index_insert(root, path->slot[0], dir_index_entries(sibling)[0].hash, dir_block);
+    image_mark_dirty(img, path->node_block[0], 1);
+    image_mark_dirty(img, path->node_block[1], 1);
+    return 0;
+}
+
+typedef struct {
+    uint32_t hash;
+    dirent64_t entry;
+} hashed_dirent_t;
+
+static int compare_hashed_dirents(const void* a, const void* b) {
+    uint32_t ha = ((const hashed_dirent_t*)a)->hash;
+    uint32_t hb = ((const hashed_dirent_t*)b)->hash;
+    return (ha > hb) - (ha < hb);
+}
+
+// Split a full leaf: entries from the median hash up move to a new leaf,
+// which is linked into the parent node. Equal hashes stay together, so a
+// name is always found in the one leaf its hash leads to.
+static int dir_index_split_leaf(fs_image_t* img, uint32_t dir_ino, inode_t* dir, dir_index_path_t* path) {
+    dirent64_t* entries = (dirent64_t*)image_block(img, path->leaf_block);
+    hashed_dirent_t sorted[DIRENTS_PER_BLOCK];
+    for (uint32_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
+        sorted[i].hash = dir_name_hash(entries[i].name);
+        sorted[i].entry = entries[i];
+    }
+    qsort(sorted, DIRENTS_PER_BLOCK, sizeof(hashed_dirent_t), compare_hashed_dirents);
+    
+    uint32_t split = DIRENTS_PER_BLOCK / 2;
+    while (split > 0 && sorted[split - 1].hash == sorted[split].hash) {
+        split--;
+    }
+    if (split == 0) {
+        // The lower half is one hash; split after it instead
+        while (split < DIRENTS_PER_BLOCK && sorted[split].hash == sorted[0].hash) {
+            split++;
+        }
+        if (split == DIRENTS_PER_BLOCK) {
+            return -1;
+        }
+    }
+    
+    uint32_t dir_block;
+    uint32_t block_no = dir_index_append(img, dir_ino, dir, &dir_block);
+    if (block_no == 0) {
+        return -1;
+    }
+    dirent64_t* upper = (dirent64_t*)image_block(img, block_no);
+    memset(entries, 0, BS);
+    for (uint32_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
+        if (i < split) {
+            entries[i] = sorted[i].entry;
+        } else {
+            upper[i - split] = sorted[i].entry;
+        }
+    }
+    
+    int parent = path->depth - 1;
+    dir_index_insert(path->node[parent], path->slot[parent], sorted[split].hash, dir_block);
+    image_mark_dirty(img, path->node_block[parent], 1);
+    image_mark_dirty(img, path->leaf_block, 1);
+    return 0;
+}
+
+// Free slot for a new name in an indexed directory, splitting leaves and
+// growing the index as needed. Returns the slot and its block, or NULL.
+static dirent64_t* dir_index_slot(fs_image_t* img, uint32_t dir_ino, inode_t* dir, const char* name,
+                                  uint32_t* block_no) {
+    uint32_t root_block;
+    dir_index_header_t* root = dir_index_root(img, dir, &root_block);
+    uint32_t hash = dir_name_hash(name);
+    
+    // A leaf split or index growth at most twice before there is room
+    for (int attempt = 0; attempt < 4; attempt++) {
+        if (root->count == 0) {
+            uint32_t dir_block;
+            if (dir_index_append(img, dir_ino, dir, &dir_block) == 0) {
+                return NULL;
+            }
+            dir_index_entries(root)[0].hash = 0;
+            dir_index_entries(root)[0].block = dir_block;
+            root->count = 1;
+            image_mark_dirty(img, root_block, 1);
+        }
+        
+        dir_index_path_t path;
+        if (dir_index_walk(img, dir, hash, &path) != 0) {
+            return NULL;
+        }
+        dirent64_t* entries = (dirent64_t*)image_block(img, path.leaf_block);
+        for (uint32_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
+            if (entries[i].inode_no == 0) {
+                *block_no = path.leaf_block;
+                return &entries[i];
+            }
+        }
+        
+        dir_index_header_t* parent = path.node[path.depth - 1];
+        int rc = parent->count == parent->limit ? dir_index_grow(img, dir_ino, dir, &path) :
+                                                  dir_index_split_leaf(img, dir_ino, dir, &path);
+        if (rc != 0) {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+// Free entry slots in the blocks a linear directory already has; an
+// indexed directory may need to split a leaf for any insert, so it counts
+// none
+uint64_t dir_free_slots(fs_image_t* img, uint32_t dir_ino) {
+    const inode_t* dir = image_inode(img, dir_ino);
+    if (dir_is_indexed(img, dir)) {
+        return 0;
+    }
+    uint64_t free_slots = 0;
+    uint64_t block_count = dir_block_count(img, dir);
+    for (uint64_t b = 0; b < block_count; b++) {
+        const dirent64_t* entries = (const dirent64_t*)image_block(img, inode_block_at(img, dir, b));
+        for (uint32_t i = b == 0 ? 2 : 0; i < DIRENTS_PER_BLOCK; i++) {
+            if (entries[i].inode_no == 0) {
+                free_slots++;
+            }
+        }
+    }
+    return free_slots;
+}
+
+// Matching entry among count slots, or NULL
+static dirent64_t* find_dirent(dirent64_t* entries, uint32_t count, const char* name) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (entries[i].inode_no != 0 && strncmp(entries[i].name, name, sizeof(entries[i].name)) == 0) {
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+// Entry called name in a directory, or NULL. An indexed directory reads
+// only the index nodes and the one leaf the name's hash leads to.
+dirent64_t* dir_lookup(fs_image_t* img, uint32_t dir_ino, const char* name) {
+    const inode_t* dir = image_inode(img, dir_ino);
+    if (dir_is_indexed(img, dir)) {
+        uint32_t block_no;
+        dir_index_header_t* root = dir_index_root(img, dir, &block_no);
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            return find_dirent((dirent64_t*)image_block(img, block_no), 2, name);
+        }
+        dir_index_path_t path;
+        if (root->count == 0 || dir_index_walk(img, dir, dir_name_hash(name), &path) != 0) {
+            return NULL;
+        }
+        return find_dirent((dirent64_t*)image_block(img, path.leaf_block), DIRENTS_PER_BLOCK, name);
+    }
+    
+    uint64_t block_count = dir_block_count(img, dir);
+    for (uint64_t b = 0; b < block_count; b++) {
+        dirent64_t* entries = (dirent64_t*)image_block(img, inode_block_at(img, dir, b));
+        dirent64_t* entry = find_dirent(entries, DIRENTS_PER_BLOCK, name);
+        if (entry) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Link inode_num into a directory under name. A linear directory takes
+// the first free slot and appends a block from the directory's group when
+// every slot is used; an indexed one goes to the leaf for the name's hash.
+// Updates the directory's size, mtime and checksum. Returns 0 or -1.
+int dir_add_entry(fs_image_t* img, uint32_t dir_ino, uint32_t inode_num, uint8_t type,
+                  const char* name, time_t now) {
+    inode_t* dir = image_inode(img, dir_ino);
+    uint32_t block_no = 0;
+    dirent64_t* entry = NULL;
+    
+    if (dir_is_indexed(img, dir)) {
+        entry = dir_index_slot(img, dir_ino, dir, name, &block_no);
+        if (!entry) {
+            return -1;
+        }
+    } else {
+        // Free slots can only be at the end, but look everywhere
+        uint64_t block_count = dir_block_count(img, dir);
+        for (uint64_t b = 0; b < block_count && !entry; b++) {
+            block_no = inode_block_at(img, dir, b);
+            dirent64_t* entries = (dirent64_t*)image_block(img, block_no);
+            for (uint32_t i = b == 0 ? 2 : 0; i < DIRENTS_PER_BLOCK; i++) {
+                if (entries[i].inode_no == 0) {
+                    entry = &entries[i];
+                    break;
+                }
+            }
+        }
+        if (!entry) {
+            block_no = dir_grow(img, dir_ino, dir, block_count);
+            if (block_no == 0) {
+                return -1;
+            }
+            entry = (dirent64_t*)image_block(img, block_no);
+        }
+    }
+    
+    memset(entry, 0, sizeof(dirent64_t));
+    entry->inode_no = inode_num;
+    entry->type = type;
+    strncpy(entry->name, name, DIRENT_NAME_MAX);
+    entry->name[DIRENT_NAME_MAX] = '\0';
+    dirent_checksum_finalize(entry);
+    image_mark_dirty(img, block_no, 1);
+    
+    dir->mtime = (uint64_t)now;
+    dir->size_bytes += sizeof(dirent64_t);
+    inode_crc_finalize(dir);
+    image_mark_inode_dirty(img, dir_ino);
+    return 0;
+}
+
+// Fill in a new directory inode and its first block: "." and "..", plus an
+// empty index on FS_FLAG_DIR_INDEX images. The block is marked dirty; the
+// caller stores the inode.
+void dir_init(fs_image_t* img, inode_t* inode, uint32_t self, uint32_t parent, uint32_t block_no,
+              time_t now) {
+    memset(inode, 0, sizeof(inode_t));
+    inode->mode = MODE_DIR;
+    inode->links = 2;       // . & the entry in the parent
+    inode->uid = 0;
+    inode->gid = 0;
+    inode->size_bytes = 2 * sizeof(dirent64_t);  // . & ..
+    inode->atime = (uint64_t)now;
+    inode->mtime = (uint64_t)now;
+    inode->ctime = (uint64_t)now;
+    if (img->sb->flags & FS_FLAG_EXTENTS) {
+        inode->extents[0].start = block_no;
+        inode->extents[0].length = 1;
+    } else {
+        inode->direct[0] = block_no;
+    }
+    inode->proj_id = PROJ_ID;
+    inode_crc_finalize(inode);
+    
+    uint8_t* block = image_block(img, block_no);
+    memset(block, 0, BS);
+    dirent64_t* entries = (dirent64_t*)block;
+    entries[0].inode_no = self;
+    entries[0].type = FILE_TYPE_DIRECTORY;
+    strcpy(entries[0].name, ".");
+    dirent_checksum_finalize(&entries[0]);
+    entries[1].inode_no = parent;
+    entries[1].type = FILE_TYPE_DIRECTORY;
+    strcpy(entries[1].name, "..");
+    dirent_checksum_finalize(&entries[1]);
+    if (img->sb->flags & FS_FLAG_DIR_INDEX) {
+        dir_index_init(block);
+    }
+    image_mark_dirty(img, block_no, 1);
+}
+
+// Allocate and fill in an empty directory whose ".." is parent_ino,
+// without linking it into the parent yet. Its inode comes from the group
+// image_dir_group picks and its first block from the same group. Returns
+// the new inode number, or 0.
+uint32_t dir_alloc(fs_image_t* img, uint32_t parent_ino, time_t now) {
+    uint32_t inode_num = image_alloc_inode(img, image_dir_group(img, image_inode_group(img, parent_ino)));
+    if (inode_num == 0) {
+        return 0;
+    }
+    extent_t block;
+    if (image_alloc_blocks(img, image_inode_group(img, inode_num), 1, &block, 1) != 1) {
+        image_free_inode(img, inode_num);
+        return 0;
+    }
+    dir_init(img, image_inode(img, inode_num), inode_num, parent_ino, block.start, now);
+    image_mark_inode_dirty(img, inode_num);
+    return inode_num;
+}
+
+// Give back a directory from dir_alloc() that was never linked
+void dir_release(fs_image_t* img, uint32_t dir_ino) {
+    inode_t* inode = image_inode(img, dir_ino);
+    uint32_t block_no = inode_block_at(img, inode, 0);
+    memset(image_block(img, block_no), 0, BS);
+    image_free_blocks(img, block_no, 1);
+    memset(inode, 0, sizeof(inode_t));
+    image_free_inode(img, dir_ino);
+}
+
+// Link a directory from dir_alloc() into its parent under name
+int dir_link(fs_image_t* img, uint32_t parent_ino, uint32_t dir_ino, const char* name, time_t now) {
+    if (dir_add_entry(img, parent_ino, dir_ino, FILE_TYPE_DIRECTORY, name, now) != 0) {
+        return -1;
+    }
+    
+    // The new directory's ".." links to the parent
+    inode_t* parent = image_inode(img, parent_ino);
+    parent->links++;
+    inode_crc_finalize(parent);
+    return 0;
+}
+
+// Create an empty directory called name inside parent_ino. Returns the new
+// inode number, or 0.
+uint32_t dir_create(fs_image_t* img, uint32_t parent_ino, const char* name, time_t now) {
+    uint32_t inode_num = dir_alloc(img, parent_ino, now);
+    if (inode_num != 0 && dir_link(img, parent_ino, inode_num, name, now) != 0) {
+        dir_release(img, inode_num);
+        return 0;
+    }
+    return inode_num;
+}
+
+// Data blocks a directory takes to hold entry_count more entries when it
+// has block_count blocks with free_slots unused entries, including new
+// pointer blocks, or spare blocks and an overflow extent block on
+// extent-mapped images. Indexed directories are counted as if every leaf
+// and index node ends up half full after splitting.
+uint64_t dir_growth_blocks(uint32_t fs_flags, int indexed, uint64_t block_count, uint64_t free_slots,
+                           uint64_t entry_count) {
+    uint64_t new_blocks;
+    if (indexed) {
+        uint64_t leaves = entry_count / (DIRENTS_PER_BLOCK / 2) + 1;
+        uint64_t nodes = leaves / ((BS / sizeof(dir_index_entry_t)) / 2) + 1;
+        new_blocks = leaves + nodes;
+    } else {
+        if (entry_count <= free_slots) {
+            return 0;
+        }
+        new_blocks = (entry_count - free_slots + DIRENTS_PER_BLOCK - 1) / DIRENTS_PER_BLOCK;
+    }
+    if (fs_flags & FS_FLAG_EXTENTS) {
+        // Extent-mapped directories may also take up to one run of spares
+        new_blocks += DIR_PREALLOC_MAX;
+        return new_blocks + (block_count + new_blocks > INODE_EXTENTS ? 1 : 0);
+    }
+    return new_blocks + inode_map_blocks(block_count + new_blocks) - inode_map_blocks(block_count);
+}
+
+// Grow a directory to at least block_count blocks up front, so the blocks
+// its entries will need sit together instead of between the data of the
+// files added to it. Indexed directories keep the extra blocks as spares.
+// Returns 0, or -1 if the image is full.
+int dir_reserve(fs_image_t* img, uint32_t dir_ino, uint64_t block_count) {
+    inode_t* dir = image_inode(img, dir_ino);
+    uint32_t group = image_inode_group(img, dir_ino);
+    uint64_t have = dir_block_count(img, dir);
+    int rc = 0;
+    while (have < block_count) {
+        uint64_t want = block_count - have;
+        uint32_t appended;
+        if (inode_append_blocks(img, dir, have, want < UINT32_MAX ? (uint32_t)want : UINT32_MAX,
+                                group, &appended) == 0) {
+            rc = -1;
+            break;
+        }
+        have += appended;
+    }
+    inode_crc_finalize(dir);
+    image_mark_inode_dirty(img, dir_ino);
+    return rc;
+}
+
+// File functions
+// Fill in a regular file inode; the block pointers are set separately
+void file_inode_init(inode_t* inode, uint64_t file_size, time_t now) {
+    memset(inode, 0, sizeof(inode_t));
+    
+    inode->mode = MODE_FILE;  // File mode
+    inode->links = 1;
+    inode->uid = 0;
+    inode->gid = 0;
+    inode->size_bytes = file_size;
+    inode->atime = (uint64_t)now;
+    inode->mtime = (uint64_t)now;
+    inode->ctime = (uint64_t)now;
+    inode->indirect = 0;
+    inode->double_indirect = 0;
+    inode->reserved_2 = 0;
+    inode->proj_id = PROJ_ID;
+    inode->uid16_gid16 = 0;
+    inode->xattr_ptr = 0;
+}
+
+// Whether a file of this size is stored inside its inode
+int file_is_inline(uint32_t fs_flags, uint64_t file_size) {
+    return (fs_flags & FS_FLAG_INLINE_DATA) && file_size <= INLINE_DATA_MAX;
+}
+
+// Data blocks a file of this size takes at most, counting pointer blocks
+// or an overflow extent block if its data ends up fragmented
+uint64_t file_blocks_needed(uint32_t fs_flags, uint64_t file_size) {
+    if (file_is_inline(fs_flags, file_size)) {
+        return 0;
+    }
+    uint64_t block_count = (file_size + BS - 1) / BS;
+    if (!(fs_flags & FS_FLAG_EXTENTS)) {
+        return block_count + inode_map_blocks(block_count);
+    }
+    return block_count + (block_count > INODE_EXTENTS ? 1 : 0);
+}
+
+// Give allocated blocks back to the image
+static void release_extents(fs_image_t* img, const extent_t* extents, int extent_count) {
+    for (int i = 0; i < extent_count; i++) {
+        image_free_blocks(img, extents[i].start, extents[i].length);
+    }
+}
+
+// Allocate the blocks for one file and point the inode at them, preferring
+// the given block group. Extent images record the runs in the inode,
+// spilling into one overflow block past INODE_EXTENTS; otherwise indirect
+// blocks are allocated together with the data. Returns the number of
+// extents taken (stored in *extents for rollback), with the data blocks in
+// file order in data_blocks, or -1.
+static int map_file_blocks(fs_image_t* img, const char* path, uint64_t block_count, uint32_t group,
+                           inode_t* inode, uint32_t* data_blocks, extent_t** extents) {
+    int use_extents = (img->sb->flags & FS_FLAG_EXTENTS) != 0;
+    
+    // Take the tightest single free run that fits, else as few of the
+    // longest runs as possible
+    uint64_t total_blocks = block_count;
+    uint64_t max_extents;
+    if (use_extents) {
+        max_extents = INODE_EXTENTS + EXTENTS_PER_BLOCK;
+    } else {
+        total_blocks += inode_map_blocks(block_count);
+        max_extents = total_blocks;
+    }
+    uint64_t free_extent_count = image_free_extent_count(img);
+    if (max_extents > free_extent_count) {
+        max_extents = free_extent_count;
+    }
+    *extents = malloc((max_extents + 1) * sizeof(extent_t));  // Room for an overflow block
+    uint32_t* blocks = malloc(total_blocks * sizeof(uint32_t));
+    if (!*extents || !blocks) {
+        print_error("Cannot allocate memory for block list of %s", path);
+        free(*extents);
+        *extents = NULL;
+        free(blocks);
+        return -1;
+    }
+    int extent_count = image_alloc_blocks(img, group, total_blocks, *extents, (int)max_extents);
+    if (extent_count < 0) {
+        print_error("Not enough free data blocks for %s (need %" PRIu64 ")", path, total_blocks);
+        free(*extents);
+        *extents = NULL;
+        free(blocks);
+        return -1;
+    }
+    
+    uint64_t block_idx = 0;
+    for (int e = 0; e < extent_count; e++) {
+        for (uint32_t i = 0; i < (*extents)[e].length; i++) {
+            blocks[block_idx++] = (*extents)[e].start + i;
+        }
+    }
+    
+    if (use_extents) {
+        // The data runs become the inode's extents
+        uint32_t overflow_block = 0;
+        if (extent_count > INODE_EXTENTS) {
+            if (image_alloc_blocks(img, group, 1, &(*extents)[extent_count], 1) != 1) {
+                print_error("Cannot allocate extent map for %s", path);
+                release_extents(img, *extents, extent_count);
+                free(*extents);
+                *extents = NULL;
+                free(blocks);
+                return -1;
+            }
+            overflow_block = (*extents)[extent_count].start;
+        }
+        inode_set_extents(img, inode, *extents, (uint32_t)extent_count, overflow_block);
+        memcpy(data_blocks, blocks, block_count * sizeof(uint32_t));
+        if (overflow_block != 0) {
+            extent_count++;
         }
-        CRC32_TAB[i] = c;
+    } else {
+        inode_set_blocks(img, inode, blocks, block_count, data_blocks);
     }
+    free(blocks);
+    return extent_count;
 }
 
-uint32_t crc32(const void* data, size_t n) {
-    const uint8_t* p = (const uint8_t*)data;
-    uint32_t c = 0xFFFFFFFFu;
-    for (size_t i = 0; i < n; i++) {
-        c = CRC32_TAB[(c ^ p[i]) & 0xFF] ^ (c >> 8);
+// Allocate an inode and data blocks for a host file of file_size bytes,
+// both from the block group of directory parent_ino when it has room, and
+// store the inode. The content is not read yet: copy receives the data
+// blocks in file order, as runs, for file_copy_read(). The inode and
+// blocks are marked dirty now so the readers never touch the dirty list.
+// Returns 0, or -1 with nothing left allocated.
+int image_alloc_file(fs_image_t* img, uint32_t parent_ino, const char* path, uint64_t file_size,
+                     time_t now, file_copy_t* copy) {
+    memset(copy, 0, sizeof(file_copy_t));
+    copy->path = path;
+    copy->size = file_size;
+    
+    // Locate free inode, resuming after the last one handed out
+    uint32_t group = image_inode_group(img, parent_ino);
+    copy->inode_num = image_alloc_inode(img, group);
+    if (copy->inode_num == 0) {
+        print_error("No free inodes available for %s", path);
+        return -1;
+    }
+    
+    inode_t inode;
+    file_inode_init(&inode, file_size, now);
+    // Tiny files live in the inode's block map area and empty files need
+    // no data block at all
+    uint64_t block_count = (file_size + BS - 1) / BS;
+    if (!file_is_inline(img->sb->flags, file_size) && block_count > 0) {
+        uint32_t* data_blocks = malloc(block_count * sizeof(uint32_t));
+        copy->runs = malloc(block_count * sizeof(extent_t));
+        if (!data_blocks || !copy->runs) {
+            print_error("Cannot allocate memory for block list of %s", path);
+            free(data_blocks);
+            file_copy_free(copy);
+            image_free_inode(img, copy->inode_num);
+            return -1;
+        }
+        copy->extent_count = map_file_blocks(img, path, block_count, image_inode_group(img, copy->inode_num),
+                                             &inode, data_blocks, &copy->extents);
+        if (copy->extent_count < 0) {
+            free(data_blocks);
+            file_copy_free(copy);
+            image_free_inode(img, copy->inode_num);
+            return -1;
+        }
+        
+        // Collect the runs of consecutive data blocks
+        for (uint64_t file_block = 0; file_block < block_count; ) {
+            uint32_t run = 1;
+            while (file_block + run < block_count &&
+                   data_blocks[file_block + run] == data_blocks[file_block] + run) {
+                run++;
+            }
+            copy->runs[copy->run_count].start = data_blocks[file_block];
+            copy->runs[copy->run_count].length = run;
+            image_mark_dirty(img, data_blocks[file_block], run);
+            copy->run_count++;
+            file_block += run;
+        }
+        free(data_blocks);
     }
-    return c ^ 0xFFFFFFFFu;
+    
+    inode_crc_finalize(&inode);
+    *image_inode(img, copy->inode_num) = inode;
+    image_mark_inode_dirty(img, copy->inode_num);
+    return 0;
 }
 
-// Checksum functions
-uint32_t superblock_crc_finalize(superblock_t *sb) {
-    sb->checksum = 0;
-    uint32_t s = crc32((void *) sb, BS - 4);
-    sb->checksum = s;
-    return s;
+// Read the content of a file allocated by image_alloc_file() straight into
+// its mapped data blocks, or into its inode if it is stored inline. Only
+// the file's own blocks and inode are written, so different files can be
+// read by different threads at the same time. Returns 0, or -1.
+int file_copy_read(fs_image_t* img, const file_copy_t* copy) {
+    int fd = open(copy->path, O_RDONLY);
+    if (fd < 0) {
+        print_error("Cannot open file %s: %s", copy->path, strerror(errno));
+        return -1;
+    }
+    
+    int rc = 0;
+    if (copy->run_count == 0) {
+        inode_t* inode = image_inode(img, copy->inode_num);
+        rc = read_exact(fd, 0, inode->inline_data, copy->size);
+        inode_crc_finalize(inode);
+    }
+    uint64_t offset = 0;
+    for (uint32_t r = 0; r < copy->run_count && rc == 0; r++) {
+        uint64_t run_bytes = (uint64_t)copy->runs[r].length * BS;
+        uint64_t bytes_to_copy = copy->size - offset < run_bytes ? copy->size - offset : run_bytes;
+        uint8_t* run_data = image_block(img, copy->runs[r].start);
+        rc = read_exact(fd, offset, run_data, bytes_to_copy);
+        memset(run_data + bytes_to_copy, 0, run_bytes - bytes_to_copy);
+        offset += run_bytes;
+    }
+    close(fd);
+    if (rc != 0) {
+        print_error("Cannot read file content of %s", copy->path);
+    }
+    return rc;
 }
 
-void inode_crc_finalize(inode_t* ino) {
-    uint8_t tmp[INODE_SIZE];
-    memcpy(tmp, ino, INODE_SIZE);
-    // Zero CRC area before computing
-    memset(&tmp[120], 0, 8);
-    uint32_t c = crc32(tmp, 120);
-    ino->inode_crc = (uint64_t)c; // Low 4 bytes carry the CRC
+// Give back the inode and every block of a file allocated by
+// image_alloc_file() that could not be stored
+void image_release_file(fs_image_t* img, file_copy_t* copy) {
+    memset(image_inode(img, copy->inode_num), 0, sizeof(inode_t));
+    release_extents(img, copy->extents, copy->extent_count);
+    image_free_inode(img, copy->inode_num);
+    file_copy_free(copy);
 }
 
-void dirent_checksum_finalize(dirent64_t* de) {
-    const uint8_t* p = (const uint8_t*)de;
-    uint8_t x = 0;
-    for (int i = 0; i < 63; i++) {
-        x ^= p[i];   // Covers ino(4) + type(1) + name(58)
+void file_copy_free(file_copy_t* copy) {
+    free(copy->runs);
+    free(copy->extents);
+    copy->runs = NULL;
+    copy->extents = NULL;
+    copy->run_count = 0;
+    copy->extent_count = 0;
+}
+
+// Bitmap scanning kernels. Each kernel looks at whole 64-bit words only;
+// callers handle the partial word at the end of the bitmap.
+// Load 64 bitmap bits starting at p; bit n of the word is bit n % 8 of byte n / 8
+static inline uint64_t load_bitmap_word(const uint8_t* p) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+// Load the last tail_bits (< 64) bits after word_idx full words, reading only
+// the bytes that exist; bits at or beyond tail_bits are returned as zero
+static inline uint64_t load_bitmap_tail(const uint8_t* bitmap, uint32_t word_idx, uint32_t tail_bits) {
+    uint64_t word = 0;
+    for (uint32_t i = 0; i < (tail_bits + 7) / 8; i++) {
+        word |= (uint64_t)bitmap[word_idx * 8 + i] << (8 * i);
     }
-    de->checksum = x;
+    return word & ((1ull << tail_bits) - 1);
+}
+
+// Index of the first word in [0, word_count) that is not all ones, or word_count
+static uint32_t first_nonfull_word_scalar(const uint8_t* bitmap, uint32_t word_count) {
+    uint32_t word_idx = 0;
+    while (word_idx < word_count && load_bitmap_word(bitmap + word_idx * 8) == UINT64_MAX) {
+        word_idx++;
+    }
+    return word_idx;
+}
+
+// Number of set bits in the first word_count words
+static uint64_t count_set_words_scalar(const uint8_t* bitmap, uint32_t word_count) {
+    uint64_t set_bits = 0;
+    for (uint32_t word_idx = 0; word_idx < word_count; word_idx++) {
+        set_bits += (uint64_t)__builtin_popcountll(load_bitmap_word(bitmap + word_idx * 8));
+    }
+    return set_bits;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// SSE2 is part of the x86-64 baseline: 128 bits per step
+static uint32_t first_nonfull_word_sse2(const uint8_t* bitmap, uint32_t word_count) {
+    const __m128i ones = _mm_set1_epi8(-1);
+    uint32_t word_idx = 0;
+    for (; word_idx + 2 <= word_count; word_idx += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(bitmap + word_idx * 8));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, ones)) != 0xFFFF) {
+            break;
+        }
+    }
+    return word_idx + first_nonfull_word_scalar(bitmap + word_idx * 8, word_count - word_idx);
+}
+
+// SWAR popcount per byte, summed with psadbw
+static uint64_t count_set_words_sse2(const uint8_t* bitmap, uint32_t word_count) {
+    const __m128i m1 = _mm_set1_epi8(0x55);
+    const __m128i m2 = _mm_set1_epi8(0x33);
+    const __m128i m4 = _mm_set1_epi8(0x0F);
+    __m128i acc = _mm_setzero_si128();
+    uint32_t word_idx = 0;
+    for (; word_idx + 2 <= word_count; word_idx += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(bitmap + word_idx * 8));
+        v = _mm_sub_epi8(v, _mm_and_si128(_mm_srli_epi16(v, 1), m1));
+        v = _mm_add_epi8(_mm_and_si128(v, m2), _mm_and_si128(_mm_srli_epi16(v, 2), m2));
+        v = _mm_and_si128(_mm_add_epi8(v, _mm_srli_epi16(v, 4)), m4);
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(v, _mm_setzero_si128()));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    return lanes[0] + lanes[1] +
+           count_set_words_scalar(bitmap + word_idx * 8, word_count - word_idx);
+}
+
+// AVX2: 256 bits per step
+__attribute__((target("avx2")))
+static uint32_t first_nonfull_word_avx2(const uint8_t* bitmap, uint32_t word_count) {
+    const __m256i ones = _mm256_set1_epi8(-1);
+    uint32_t word_idx = 0;
+    for (; word_idx + 4 <= word_count; word_idx += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(bitmap + word_idx * 8));
+        if (!_mm256_testc_si256(v, ones)) {
+            break;
+        }
+    }
+    return word_idx + first_nonfull_word_scalar(bitmap + word_idx * 8, word_count - word_idx);
+}
+
+// Nibble lookup popcount (vpshufb), summed with vpsadbw
+__attribute__((target("avx2")))
+static uint64_t count_set_words_avx2(const uint8_t* bitmap, uint32_t word_count) {
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0F);
+    __m256i acc = _mm256_setzero_si256();
+    uint32_t word_idx = 0;
+    for (; word_idx + 4 <= word_count; word_idx += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(bitmap + word_idx * 8));
+        __m256i lo = _mm256_and_si256(v, low_mask);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+        __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+                                         _mm256_shuffle_epi8(lookup, hi));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+           count_set_words_scalar(bitmap + word_idx * 8, word_count - word_idx);
+}
+#endif
+
+typedef struct {
+    uint32_t (*first_nonfull_word)(const uint8_t* bitmap, uint32_t word_count);
+    uint64_t (*count_set_words)(const uint8_t* bitmap, uint32_t word_count);
+} bitmap_kernels_t;
+
+static const bitmap_kernels_t BITMAP_KERNELS_SCALAR = {
+    first_nonfull_word_scalar, count_set_words_scalar
+};
+#if defined(__x86_64__) && defined(__GNUC__)
+static const bitmap_kernels_t BITMAP_KERNELS_SSE2 = {
+    first_nonfull_word_sse2, count_set_words_sse2
+};
+static const bitmap_kernels_t BITMAP_KERNELS_AVX2 = {
+    first_nonfull_word_avx2, count_set_words_avx2
+};
+#endif
+
+// Pick the widest kernels this CPU supports on first use
+static const bitmap_kernels_t* bitmap_kernels(void) {
+    static const bitmap_kernels_t* selected = NULL;
+    const bitmap_kernels_t* kernels = __atomic_load_n(&selected, __ATOMIC_RELAXED);
+    if (kernels) {
+        return kernels;
+    }
+    
+    kernels = &BITMAP_KERNELS_SCALAR;
+#if defined(__x86_64__) && defined(__GNUC__)
+    kernels = __builtin_cpu_supports("avx2") ? &BITMAP_KERNELS_AVX2 : &BITMAP_KERNELS_SSE2;
+#endif
+    __atomic_store_n(&selected, kernels, __ATOMIC_RELAXED);
+    return kernels;
 }
 
 // Utility functions
-int find_free_bit(uint8_t* bitmap, uint32_t max_bits) {
-    for (uint32_t byte_idx = 0; byte_idx < (max_bits + 7) / 8; byte_idx++) {
-        if (bitmap[byte_idx] != 0xFF) {  // If a byte has at least one free bit
-            for (int bit_idx = 0; bit_idx < 8; bit_idx++) {
-                if ((bitmap[byte_idx] & (1 << bit_idx)) == 0) {
-                    int bit_number = byte_idx * 8 + bit_idx;
-                    if ((uint32_t)bit_number < max_bits) {
-                        return bit_number;
-                    }
-                }
-            }
+// First bit at or after from whose value is value (0 or 1), or max_bits
+static uint32_t find_next_bit_value(const uint8_t* bitmap, uint32_t max_bits, uint32_t from, int value) {
+    uint32_t full_words = max_bits / 64;
+    for (uint64_t word_idx = from / 64; word_idx * 64 < max_bits; word_idx++) {
+        uint64_t word = word_idx < full_words ?
+            load_bitmap_word(bitmap + word_idx * 8) :
+            load_bitmap_tail(bitmap, (uint32_t)word_idx, max_bits % 64);
+        if (!value) {
+            word = ~word;
+        }
+        if (word_idx == from / 64) {
+            word &= UINT64_MAX << (from % 64);
+        }
+        if (word != 0) {
+            uint64_t bit = word_idx * 64 + (uint64_t)__builtin_ctzll(word);
+            return bit < max_bits ? (uint32_t)bit : max_bits;
         }
     }
-    return -1;  // Return -1 if no free bit found
+    return max_bits;
 }
 
 void set_bit(uint8_t* bitmap, int bit_number) {
@@ -72,6 +1992,433 @@ void set_bit(uint8_t* bitmap, int bit_number) {
     bitmap[byte_idx] |= (1 << bit_idx);
 }
 
+void clear_bit(uint8_t* bitmap, int bit_number) {
+    int byte_idx = bit_number / 8;
+    int bit_idx = bit_number % 8;
+    bitmap[byte_idx] &= (uint8_t)~(1 << bit_idx);
+}
+
+uint64_t count_free_bits(const uint8_t* bitmap, uint32_t max_bits) {
+    uint32_t full_words = max_bits / 64;
+    uint64_t set_bits = bitmap_kernels()->count_set_words(bitmap, full_words);
+    if (max_bits % 64 != 0) {
+        set_bits += (uint64_t)__builtin_popcountll(load_bitmap_tail(bitmap, full_words, max_bits % 64));
+    }
+    return max_bits - set_bits;
+}
+
+void set_bit_range(uint8_t* bitmap, uint32_t start, uint32_t length) {
+    for (uint32_t bit = start; bit < start + length; bit++) {
+        set_bit(bitmap, (int)bit);
+    }
+}
+
+void clear_bit_range(uint8_t* bitmap, uint32_t start, uint32_t length) {
+    for (uint32_t bit = start; bit < start + length; bit++) {
+        clear_bit(bitmap, (int)bit);
+    }
+}
+
+static int compare_extents_by_start(const void* a, const void* b) {
+    const extent_t* ea = (const extent_t*)a;
+    const extent_t* eb = (const extent_t*)b;
+    return (ea->start > eb->start) - (ea->start < eb->start);
+}
+
+// Free-bit index. Level 0 has one bit per 64-bit bitmap word, set while
+// that word still has a clear bit below max_bits; each level above has one
+// bit per word of the level below, set while that word is nonzero. Finding
+// the next free bit walks up until a masked word is nonzero and back down
+// with one ctz per level.
+static uint64_t index_word_free_mask(const bitmap_index_t* index, uint32_t word_idx) {
+    uint32_t full_words = index->max_bits / 64;
+    if (word_idx < full_words) {
+        return ~load_bitmap_word(index->bitmap + word_idx * 8);
+    }
+    uint32_t tail_bits = index->max_bits % 64;
+    return ~load_bitmap_tail(index->bitmap, word_idx, tail_bits) & ((1ull << tail_bits) - 1);
+}
+
+int bitmap_index_build(bitmap_index_t* index, uint8_t* bitmap, uint32_t max_bits) {
+    memset(index, 0, sizeof(bitmap_index_t));
+    index->bitmap = bitmap;
+    index->max_bits = max_bits;
+    
+    // Size the levels until one word covers the top
+    uint64_t level_bits = ((uint64_t)max_bits + 63) / 64;
+    size_t total_words = 0;
+    do {
+        index->level_bits[index->levels] = (uint32_t)level_bits;
+        total_words += (size_t)((level_bits + 63) / 64);
+        index->levels++;
+        level_bits = (level_bits + 63) / 64;
+    } while (index->level_bits[index->levels - 1] > 64 && index->levels < BITMAP_INDEX_MAX_LEVELS);
+    
+    index->storage = calloc(total_words ? total_words : 1, sizeof(uint64_t));
+    if (!index->storage) {
+        print_error("Cannot allocate memory for bitmap index");
+        return -1;
+    }
+    uint64_t* next = index->storage;
+    for (int level = 0; level < index->levels; level++) {
+        index->level[level] = next;
+        next += (index->level_bits[level] + 63) / 64;
+    }
+    
+    // One pass over the bitmap fills level 0, letting the kernels skip runs
+    // of fully used words; upper levels follow from it
+    const bitmap_kernels_t* kernels = bitmap_kernels();
+    uint32_t full_words = max_bits / 64;
+    uint32_t word_idx = kernels->first_nonfull_word(bitmap, full_words);
+    while (word_idx < full_words) {
+        index->level[0][word_idx / 64] |= 1ull << (word_idx % 64);
+        word_idx++;
+        word_idx += kernels->first_nonfull_word(bitmap + word_idx * 8, full_words - word_idx);
+    }
+    if (full_words < index->level_bits[0] && index_word_free_mask(index, full_words) != 0) {
+        index->level[0][full_words / 64] |= 1ull << (full_words % 64);
+    }
+    for (int level = 1; level < index->levels; level++) {
+        for (uint32_t i = 0; i < index->level_bits[level]; i++) {
+            if (index->level[level - 1][i] != 0) {
+                index->level[level][i / 64] |= 1ull << (i % 64);
+            }
+        }
+    }
+    return 0;
+}
+
+void bitmap_index_free(bitmap_index_t* index) {
+    free(index->storage);
+    memset(index, 0, sizeof(bitmap_index_t));
+}
+
+// Record whether a bitmap word has a free bit, propagating up while the
+// nonzero-ness of a summary word changes
+static void index_refresh_word(bitmap_index_t* index, uint32_t word_idx) {
+    int has_free = index_word_free_mask(index, word_idx) != 0;
+    uint64_t bit = word_idx;
+    for (int level = 0; level < index->levels; level++) {
+        uint64_t* word = &index->level[level][bit / 64];
+        int was_nonzero = *word != 0;
+        if (has_free) {
+            *word |= 1ull << (bit % 64);
+        } else {
+            *word &= ~(1ull << (bit % 64));
+        }
+        int is_nonzero = *word != 0;
+        if (was_nonzero == is_nonzero) {
+            break;
+        }
+        has_free = is_nonzero;
+        bit /= 64;
+    }
+}
+
+// First bitmap word at or after word_idx that has a free bit, or -1
+static int64_t index_next_word(const bitmap_index_t* index, uint64_t word_idx) {
+    uint64_t pos = word_idx;
+    int level = 0;
+    for (;;) {
+        if (pos >= index->level_bits[level]) {
+            return -1;
+        }
+        uint64_t word = index->level[level][pos / 64] & (UINT64_MAX << (pos % 64));
+        if (word != 0) {
+            pos = (pos / 64) * 64 + (uint64_t)__builtin_ctzll(word);
+            break;
+        }
+        if (level + 1 == index->levels) {
+            return -1;
+        }
+        pos = pos / 64 + 1;
+        level++;
+    }
+    while (level > 0) {
+        level--;
+        pos = pos * 64 + (uint64_t)__builtin_ctzll(index->level[level][pos]);
+    }
+    return (int64_t)pos;
+}
+
+// Lowest clear bit at or after start, or max_bits if there is none
+uint32_t bitmap_index_find_next(const bitmap_index_t* index, uint32_t start) {
+    if (start >= index->max_bits) {
+        return index->max_bits;
+    }
+    uint32_t word_idx = start / 64;
+    uint64_t free_bits = index_word_free_mask(index, word_idx) & (UINT64_MAX << (start % 64));
+    if (free_bits != 0) {
+        return word_idx * 64 + (uint32_t)__builtin_ctzll(free_bits);
+    }
+    int64_t next = index_next_word(index, (uint64_t)word_idx + 1);
+    if (next < 0) {
+        return index->max_bits;
+    }
+    return (uint32_t)next * 64 + (uint32_t)__builtin_ctzll(index_word_free_mask(index, (uint32_t)next));
+}
+
+// Next-fit search: lowest clear bit at or after start, wrapping around to
+// bit 0. Returns -1 if the bitmap is full.
+int bitmap_index_find_free(const bitmap_index_t* index, uint32_t start) {
+    uint32_t bit = bitmap_index_find_next(index, start);
+    if (bit == index->max_bits && start > 0) {
+        bit = bitmap_index_find_next(index, 0);
+    }
+    return bit < index->max_bits ? (int)bit : -1;
+}
+
+void bitmap_index_set_range(bitmap_index_t* index, uint32_t start, uint32_t length) {
+    if (length == 0) {
+        return;
+    }
+    set_bit_range(index->bitmap, start, length);
+    for (uint32_t word_idx = start / 64; word_idx <= (start + length - 1) / 64; word_idx++) {
+        index_refresh_word(index, word_idx);
+    }
+}
+
+void bitmap_index_clear_range(bitmap_index_t* index, uint32_t start, uint32_t length) {
+    if (length == 0) {
+        return;
+    }
+    clear_bit_range(index->bitmap, start, length);
+    for (uint32_t word_idx = start / 64; word_idx <= (start + length - 1) / 64; word_idx++) {
+        index_refresh_word(index, word_idx);
+    }
+}
+
+// Free-extent index: the free runs of a bitmap kept in two sorted arrays,
+// one ordered by start (for coalescing) and one by (length, start) (for
+// best fit). Lookups are binary searches; updates shift the array tail.
+static int compare_extents_by_length(const void* a, const void* b) {
+    const extent_t* ea = (const extent_t*)a;
+    const extent_t* eb = (const extent_t*)b;
+    if (ea->length != eb->length) {
+        return ea->length < eb->length ? -1 : 1;
+    }
+    return (ea->start > eb->start) - (ea->start < eb->start);
+}
+
+// First index in by_start whose start is greater than start
+static uint32_t extents_upper_bound_start(const free_extents_t* fe, uint32_t start) {
+    uint32_t lo = 0;
+    uint32_t hi = fe->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (fe->by_start[mid].start <= start) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// First index in by_length not ordered before (length, start)
+static uint32_t extents_lower_bound_length(const free_extents_t* fe, uint32_t length, uint32_t start) {
+    uint32_t lo = 0;
+    uint32_t hi = fe->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const extent_t* e = &fe->by_length[mid];
+        if (e->length < length || (e->length == length && e->start < start)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int extents_reserve_slot(free_extents_t* fe) {
+    if (fe->count < fe->capacity) {
+        return 0;
+    }
+    uint32_t new_capacity = fe->capacity ? fe->capacity * 2 : 64;
+    extent_t* by_start = realloc(fe->by_start, new_capacity * sizeof(extent_t));
+    if (!by_start) {
+        print_error("Cannot allocate memory for free extent index");
+        return -1;
+    }
+    fe->by_start = by_start;
+    extent_t* by_length = realloc(fe->by_length, new_capacity * sizeof(extent_t));
+    if (!by_length) {
+        print_error("Cannot allocate memory for free extent index");
+        return -1;
+    }
+    fe->by_length = by_length;
+    fe->capacity = new_capacity;
+    return 0;
+}
+
+static void extents_insert(free_extents_t* fe, extent_t extent) {
+    uint32_t i = extents_upper_bound_start(fe, extent.start);
+    memmove(&fe->by_start[i + 1], &fe->by_start[i], (fe->count - i) * sizeof(extent_t));
+    fe->by_start[i] = extent;
+    uint32_t j = extents_lower_bound_length(fe, extent.length, extent.start);
+    memmove(&fe->by_length[j + 1], &fe->by_length[j], (fe->count - j) * sizeof(extent_t));
+    fe->by_length[j] = extent;
+    fe->count++;
+    fe->free_blocks += extent.length;
+}
+
+// Remove the free extent at position i of by_start
+static void extents_remove(free_extents_t* fe, uint32_t i) {
+    extent_t extent = fe->by_start[i];
+    memmove(&fe->by_start[i], &fe->by_start[i + 1], (fe->count - i - 1) * sizeof(extent_t));
+    uint32_t j = extents_lower_bound_length(fe, extent.length, extent.start);
+    memmove(&fe->by_length[j], &fe->by_length[j + 1], (fe->count - j - 1) * sizeof(extent_t));
+    fe->count--;
+    fe->free_blocks -= extent.length;
+}
+
+int free_extents_build(free_extents_t* fe, const uint8_t* bitmap, uint32_t max_bits) {
+    memset(fe, 0, sizeof(free_extents_t));
+    
+    // Runs come out of the bitmap already ordered by start
+    uint32_t pos = 0;
+    while ((pos = find_next_bit_value(bitmap, max_bits, pos, 0)) < max_bits) {
+        uint32_t end = find_next_bit_value(bitmap, max_bits, pos, 1);
+        if (extents_reserve_slot(fe) != 0) {
+            free_extents_free(fe);
+            return -1;
+        }
+        fe->by_start[fe->count].start = pos;
+        fe->by_start[fe->count].length = end - pos;
+        fe->count++;
+        fe->free_blocks += end - pos;
+        pos = end;
+    }
+    if (fe->count > 0) {
+        memcpy(fe->by_length, fe->by_start, fe->count * sizeof(extent_t));
+        qsort(fe->by_length, fe->count, sizeof(extent_t), compare_extents_by_length);
+    }
+    return 0;
+}
+
+void free_extents_free(free_extents_t* fe) {
+    free(fe->by_start);
+    free(fe->by_length);
+    memset(fe, 0, sizeof(free_extents_t));
+}
+
+int free_extents_reserve(free_extents_t* fe, uint32_t start, uint32_t length) {
+    uint32_t i = extents_upper_bound_start(fe, start);
+    if (length == 0 || i == 0) {
+        return length == 0 ? 0 : -1;
+    }
+    extent_t extent = fe->by_start[i - 1];
+    if ((uint64_t)start + length > (uint64_t)extent.start + extent.length) {
+        return -1;  // Not entirely free
+    }
+    
+    // Splitting can leave two pieces, so make room before touching anything
+    if (extents_reserve_slot(fe) != 0) {
+        return -1;
+    }
+    extents_remove(fe, i - 1);
+    if (start > extent.start) {
+        extents_insert(fe, (extent_t){extent.start, start - extent.start});
+    }
+    uint32_t end = start + length;
+    if (end < extent.start + extent.length) {
+        extents_insert(fe, (extent_t){end, extent.start + extent.length - end});
+    }
+    return 0;
+}
+
+int free_extents_release(free_extents_t* fe, uint32_t start, uint32_t length) {
+    if (length == 0) {
+        return 0;
+    }
+    uint32_t i = extents_upper_bound_start(fe, start);
+    extent_t merged = {start, length};
+    
+    // Refuse ranges that overlap free space already in the index
+    if (i > 0) {
+        const extent_t* prev = &fe->by_start[i - 1];
+        if ((uint64_t)prev->start + prev->length > start) {
+            return -1;
+        }
+    }
+    if (i < fe->count && (uint64_t)start + length > fe->by_start[i].start) {
+        return -1;
+    }
+    if (extents_reserve_slot(fe) != 0) {
+        return -1;
+    }
+    
+    // Coalesce with the neighbours on either side
+    if (i < fe->count && start + length == fe->by_start[i].start) {
+        merged.length += fe->by_start[i].length;
+        extents_remove(fe, i);
+    }
+    if (i > 0 && fe->by_start[i - 1].start + fe->by_start[i - 1].length == start) {
+        merged.start = fe->by_start[i - 1].start;
+        merged.length += fe->by_start[i - 1].length;
+        extents_remove(fe, i - 1);
+    }
+    extents_insert(fe, merged);
+    return 0;
+}
+
+int free_extents_alloc(free_extents_t* fe, uint32_t count, extent_t* extents, int max_extents,
+                       uint32_t hint) {
+    if (count == 0) {
+        return 0;
+    }
+    if (fe->free_blocks < count || max_extents < 1) {
+        return -1;
+    }
+    
+    // Best fit: the shortest run that holds everything. Among runs of that
+    // length, take the first one starting at or after hint, else the lowest.
+    uint32_t best = extents_lower_bound_length(fe, count, 0);
+    if (best < fe->count) {
+        uint32_t next = extents_lower_bound_length(fe, fe->by_length[best].length, hint);
+        if (next < fe->count && fe->by_length[next].length == fe->by_length[best].length) {
+            best = next;
+        }
+        extents[0].start = fe->by_length[best].start;
+        extents[0].length = count;
+        return free_extents_reserve(fe, extents[0].start, count) == 0 ? 1 : -1;
+    }
+    
+    // No single run is long enough: take the longest runs first
+    int extent_count = 0;
+    uint32_t remaining = count;
+    for (uint32_t i = fe->count; i > 0 && remaining > 0 && extent_count < max_extents; i--) {
+        const extent_t* run = &fe->by_length[i - 1];
+        uint32_t take = run->length < remaining ? run->length : remaining;
+        extents[extent_count].start = run->start;
+        extents[extent_count].length = take;
+        extent_count++;
+        remaining -= take;
+    }
+    if (remaining > 0) {
+        return -1;
+    }
+    
+    qsort(extents, (size_t)extent_count, sizeof(extent_t), compare_extents_by_start);
+    for (int i = 0; i < extent_count; i++) {
+        if (free_extents_reserve(fe, extents[i].start, extents[i].length) != 0) {
+            // Give back the runs already carved out, so a failed call
+            // leaves the index as it found it; the reservations only freed
+            // slots, so releasing them needs no memory
+            while (i-- > 0) {
+                free_extents_release(fe, extents[i].start, extents[i].length);
+            }
+            return -1;
+        }
+    }
+    return extent_count;
+}
+
+uint32_t free_extents_largest(const free_extents_t* fe) {
+    return fe->count > 0 ? fe->by_length[fe->count - 1].length : 0;
+}
+
 const char* extract_filename(const char* path) {
     const char* filename = strrchr(path, '/');
     if (filename) {
@@ -128,6 +2475,261 @@ uint8_t* read_file_content(const char* filename, uint64_t* file_size) {
     return content;
 }
 
+// Read exactly size bytes at offset of an open file into dst
+int read_exact(int fd, uint64_t offset, uint8_t* dst, uint64_t size) {
+    uint64_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, dst + done, (size_t)(size - done), (off_t)(offset + done));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += (uint64_t)n;
+    }
+    return 0;
+}
+
+// Concurrent bitmap functions. Bits are claimed with 64-bit atomic
+// fetch-or and compare-and-swap on the bitmap words, so several threads
+// can allocate from the same bitmap without a lock. Bitmaps start on a
+// block boundary and cover whole blocks, so every word is aligned and
+// inside the bitmap; bits at or past max_bits are never handed out.
+
+// Bitmap bit n % 64 of the word holding it, in the word's memory order
+static inline uint64_t atomic_word_bit(uint32_t bit) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return 1ull << ((7 - (bit % 64) / 8) * 8 + bit % 8);
+#else
+    return 1ull << (bit % 64);
+#endif
+}
+
+// Convert a word between memory order and bitmap order (bit n of the
+// result is bitmap bit n); the conversion is its own inverse
+static inline uint64_t atomic_word_order(uint64_t word) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_bswap64(word);
+#else
+    return word;
+#endif
+}
+
+static inline uint64_t* atomic_bitmap_word(uint8_t* bitmap, uint32_t word_idx) {
+    return (uint64_t*)(void*)(bitmap + (size_t)word_idx * 8);
+}
+
+// Bitmap-order mask of the bits of word word_idx that lie past max_bits
+static inline uint64_t atomic_tail_mask(uint32_t max_bits, uint32_t word_idx) {
+    if ((uint64_t)(word_idx + 1) * 64 <= max_bits) {
+        return 0;
+    }
+    return ~0ull << (max_bits - word_idx * 64);
+}
+
+// Claim one given bit. Returns 1 if this call set it, 0 if it was already set.
+int atomic_claim_bit(uint8_t* bitmap, uint32_t bit) {
+    uint64_t mask = atomic_word_bit(bit);
+    uint64_t old = __atomic_fetch_or(atomic_bitmap_word(bitmap, bit / 64), mask, __ATOMIC_ACQ_REL);
+    return (old & mask) == 0;
+}
+
+// Clear a claimed range of bits
+void atomic_release_bits(uint8_t* bitmap, uint32_t start, uint32_t length) {
+    uint32_t bit = start;
+    while (bit < start + length) {
+        uint32_t word_idx = bit / 64;
+        uint64_t mask = 0;
+        for (; bit < start + length && bit / 64 == word_idx; bit++) {
+            mask |= atomic_word_bit(bit);
+        }
+        __atomic_fetch_and(atomic_bitmap_word(bitmap, word_idx), ~mask, __ATOMIC_ACQ_REL);
+    }
+}
+
+// Claim up to count leading free bits of a word with compare-and-swap,
+// taking whatever prefix of them is free. Returns the number claimed.
+static uint32_t atomic_claim_prefix(uint8_t* bitmap, uint32_t max_bits, uint32_t word_idx, uint32_t count) {
+    uint64_t* word = atomic_bitmap_word(bitmap, word_idx);
+    uint64_t old = __atomic_load_n(word, __ATOMIC_ACQUIRE);
+    for (;;) {
+        uint64_t used = atomic_word_order(old) | atomic_tail_mask(max_bits, word_idx);
+        uint32_t length = used == 0 ? 64 : (uint32_t)__builtin_ctzll(used);
+        if (length > count) {
+            length = count;
+        }
+        if (length == 0) {
+            return 0;
+        }
+        uint64_t run = length == 64 ? ~0ull : ((1ull << length) - 1);
+        if (__atomic_compare_exchange_n(word, &old, old | atomic_word_order(run), 0, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE)) {
+            return length;
+        }
+    }
+}
+
+// Claim a run of up to count free bits, searching word by word from
+// *cursor and wrapping around once. The first free run found in a word is
+// taken with compare-and-swap, retried if another thread changed the word
+// in between; a run that reaches the end of its word continues into the
+// free bits at the start of the next. *cursor is left at the word of the
+// run so the next call starts there; threads given cursors in different
+// parts of the bitmap rarely touch the same word. Returns the first bit
+// with its length in *claimed, or -1 if the bitmap is full.
+int64_t atomic_claim_run(uint8_t* bitmap, uint32_t max_bits, uint32_t count, uint32_t* cursor,
+                         uint32_t* claimed) {
+    uint32_t word_count = (max_bits + 63) / 64;
+    if (count == 0 || word_count == 0) {
+        return -1;
+    }
+    uint32_t start_word = *cursor < word_count ? *cursor : 0;
+    for (uint32_t n = 0; n < word_count; n++) {
+        uint32_t word_idx = (start_word + n) % word_count;
+        uint64_t* word = atomic_bitmap_word(bitmap, word_idx);
+        uint64_t old = __atomic_load_n(word, __ATOMIC_ACQUIRE);
+        for (;;) {
+            uint64_t used = atomic_word_order(old) | atomic_tail_mask(max_bits, word_idx);
+            if (used == ~0ull) {
+                break;  // Full, or taken meanwhile: try the next word
+            }
+            uint32_t first = (uint32_t)__builtin_ctzll(~used);
+            uint64_t above = used >> first;
+            uint32_t length = above == 0 ? 64 - first : (uint32_t)__builtin_ctzll(above);
+            if (length > count) {
+                length = count;
+            }
+            uint64_t run = (length == 64 ? ~0ull : ((1ull << length) - 1)) << first;
+            if (length == 1) {
+                // A single bit needs no compare-and-swap: fetch-or tells
+                // whether it was still free
+                uint32_t bit = word_idx * 64 + first;
+                if (!atomic_claim_bit(bitmap, bit)) {
+                    old = __atomic_load_n(word, __ATOMIC_ACQUIRE);
+                    continue;
+                }
+            } else if (!__atomic_compare_exchange_n(word, &old, old | atomic_word_order(run), 0,
+                                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                continue;
+            }
+            
+            uint32_t next = word_idx + 1;
+            while (first + length == (next - word_idx) * 64 && length < count && next < word_count) {
+                uint32_t more = atomic_claim_prefix(bitmap, max_bits, next, count - length);
+                length += more;
+                if (more < 64) {
+                    break;
+                }
+                next++;
+            }
+            *cursor = word_idx;
+            *claimed = length;
+            return (int64_t)word_idx * 64 + first;
+        }
+    }
+    return -1;
+}
+
+// Concurrent allocation functions. Between image_concurrent_begin() and
+// image_concurrent_end(), any number of threads may claim inodes and
+// blocks with their own alloc_cursor_t; the single-threaded allocators and
+// the in-memory indexes must not be used in that window.
+
+// Mark every bitmap block dirty up front, since the dirty list is not
+// thread-safe, before threads start claiming
+int image_concurrent_begin(fs_image_t* img) {
+    for (uint32_t g = 0; g < img->group_count; g++) {
+        fs_group_t* group = &img->groups[g];
+        if (image_mark_dirty(img, group->inode_bitmap_start,
+                             (group->inode_count + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK) != 0 ||
+            image_mark_dirty(img, group->data_bitmap_start,
+                             (group->data_region_blocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Rebuild the in-memory indexes from the bitmaps once every thread is
+// done, so the single-threaded allocators can be used again
+int image_concurrent_end(fs_image_t* img) {
+    for (uint32_t g = 0; g < img->group_count; g++) {
+        bitmap_index_free(&img->groups[g].inode_index);
+        bitmap_index_free(&img->groups[g].data_index);
+        free_extents_free(&img->groups[g].data_extents);
+    }
+    return image_build_indexes(img);
+}
+
+// Give thread `thread` of thread_count its starting point: threads are
+// spread evenly over the groups, and over the words of a group when there
+// are more threads than groups
+void alloc_cursor_init(const fs_image_t* img, alloc_cursor_t* cursor, uint32_t thread,
+                       uint32_t thread_count) {
+    uint64_t slot = (uint64_t)thread * img->group_count;
+    uint32_t group = (uint32_t)(slot / thread_count);
+    uint64_t offset = slot % thread_count;  // Share of the group, in 1/thread_count
+    const fs_group_t* first = &img->groups[group];
+    cursor->inode_group = group;
+    cursor->inode_word = (uint32_t)(offset * ((first->inode_count + 63) / 64) / thread_count);
+    cursor->data_group = group;
+    cursor->data_word = (uint32_t)(offset * ((first->data_region_blocks + 63) / 64) / thread_count);
+}
+
+// Claim a free inode, starting at the cursor and moving on group by group.
+// Returns the inode number, or 0 if none is free.
+uint32_t image_claim_inode(fs_image_t* img, alloc_cursor_t* cursor) {
+    for (uint32_t n = 0; n < img->group_count; n++) {
+        fs_group_t* group = &img->groups[cursor->inode_group];
+        uint32_t claimed;
+        int64_t bit = atomic_claim_run(group->inode_bitmap, group->inode_count, 1, &cursor->inode_word,
+                                       &claimed);
+        if (bit >= 0) {
+            return group->first_inode + (uint32_t)bit;
+        }
+        cursor->inode_group = (cursor->inode_group + 1) % img->group_count;
+        cursor->inode_word = 0;
+    }
+    return 0;
+}
+
+// Claim a run of up to count free data blocks, starting at the cursor and
+// moving on group by group. Returns the first absolute block with the run
+// length in *claimed, or 0 if the image is full.
+uint32_t image_claim_blocks(fs_image_t* img, alloc_cursor_t* cursor, uint32_t count, uint32_t* claimed) {
+    for (uint32_t n = 0; n < img->group_count; n++) {
+        fs_group_t* group = &img->groups[cursor->data_group];
+        int64_t bit = atomic_claim_run(group->data_bitmap, group->data_region_blocks, count,
+                                       &cursor->data_word, claimed);
+        if (bit >= 0) {
+            return (uint32_t)(group->data_region_start + (uint64_t)bit);
+        }
+        cursor->data_group = (cursor->data_group + 1) % img->group_count;
+        cursor->data_word = 0;
+    }
+    return 0;
+}
+
+// Give back an inode claimed with image_claim_inode()
+void image_unclaim_inode(fs_image_t* img, uint32_t inode_num) {
+    uint32_t g = image_inode_group(img, inode_num);
+    atomic_release_bits(img->groups[g].inode_bitmap, inode_num - img->groups[g].first_inode, 1);
+}
+
+// Give back blocks claimed with image_claim_blocks()
+void image_unclaim_blocks(fs_image_t* img, uint32_t first_block, uint32_t count) {
+    for (uint32_t g = 0; g < img->group_count; g++) {
+        fs_group_t* group = &img->groups[g];
+        if (first_block >= group->data_region_start &&
+            first_block < group->data_region_start + group->data_region_blocks) {
+            atomic_release_bits(group->data_bitmap, (uint32_t)(first_block - group->data_region_start),
+                                count);
+            return;
+        }
+    }
+}
+
 // Error handling functions
 void print_error(const char* format, ...) {
     va_list args;
@@ -1,11 +1,251 @@
-// Build: gcc -O2 -std=c17 -Wall -Wextra mkfs_adder.c minivsfs_utils.c -o mkfs_adder
+// Build: make
 #include "minivsfs.h"
+#include <dirent.h>
+
+// A file to add, validated before the image is touched
+typedef struct {
+    const char* path;
+    const char* dest;                 // Path in the image, relative to the root
+    const char* name;                 // Last component of dest
+    size_t parent;                    // Index of the parent in the directory plan
+    uint64_t size;
+    uint64_t block_count;
+    uint32_t inode_num;
+    file_copy_t copy;                 // Blocks allocated for the content
+} pending_file_t;
+
+// A directory the batch goes into, found in the image or created by this run
+typedef struct {
+    char* path;                       // Relative to the root, "" for the root
+    size_t parent;                    // Index of the parent in the plan
+    uint32_t inode_num;               // 0 until the directory exists
+    int created;                      // Allocated by this run
+    uint64_t entry_count;             // New entries it receives
+} pending_dir_t;
+
+// Join a destination directory and a relative path into a path relative
+// to the image root, dropping empty and "." components. Returns a heap
+// string, or NULL for ".." components and paths that name no file.
+char* join_dest_path(const char* dest_dir, const char* rel) {
+    size_t len = (dest_dir ? strlen(dest_dir) : 0) + 1 + strlen(rel) + 1;
+    char* joined = malloc(len);
+    char* dest = malloc(len);
+    if (!joined || !dest) {
+        print_error("Cannot allocate memory for file list");
+        free(joined);
+        free(dest);
+        return NULL;
+    }
+    snprintf(joined, len, "%s/%s", dest_dir ? dest_dir : "", rel);
+    
+    size_t out = 0;
+    char* saveptr = NULL;
+    for (char* part = strtok_r(joined, "/", &saveptr); part; part = strtok_r(NULL, "/", &saveptr)) {
+        if (strcmp(part, ".") == 0) {
+            continue;
+        }
+        if (strcmp(part, "..") == 0) {
+            print_error("Destination %s%s%s may not contain '..'", dest_dir ? dest_dir : "",
+                        dest_dir ? "/" : "", rel);
+            free(joined);
+            free(dest);
+            return NULL;
+        }
+        out += (size_t)sprintf(dest + out, "%s%s", out > 0 ? "/" : "", part);
+    }
+    free(joined);
+    if (out == 0) {
+        print_error("%s does not name a file", rel);
+        free(dest);
+        return NULL;
+    }
+    return dest;
+}
+
+// Append a heap-allocated path and its heap-allocated destination to the
+// list of files to add
+int append_filename(cli_args_adder_t* args, char* path, char* dest) {
+    if (!path || !dest) {
+        if (!path) {
+            print_error("Cannot allocate memory for file list");
+        }
+        free(path);
+        free(dest);
+        return -1;
+    }
+    if (args->file_count == args->file_capacity) {
+        size_t new_capacity = args->file_capacity ? args->file_capacity * 2 : 16;
+        char** grown = realloc(args->filenames, new_capacity * sizeof(char*));
+        if (grown) {
+            args->filenames = grown;
+            grown = realloc(args->dest_paths, new_capacity * sizeof(char*));
+        }
+        if (!grown) {
+            print_error("Cannot allocate memory for file list");
+            free(path);
+            free(dest);
+            return -1;
+        }
+        args->dest_paths = grown;
+        args->file_capacity = new_capacity;
+    }
+    args->filenames[args->file_count] = path;
+    args->dest_paths[args->file_count++] = dest;
+    return 0;
+}
+
+// Append a host file named on the command line or in a list: it goes into
+// --dest under its own name, or under the whole given path with --parents
+int append_host_file(cli_args_adder_t* args, const char* path) {
+    char* dest = join_dest_path(args->dest_dir, args->parents ? path : extract_filename(path));
+    return append_filename(args, strdup(path), dest);
+}
+
+void free_cli_args(cli_args_adder_t* args) {
+    for (size_t i = 0; i < args->file_count; i++) {
+        free(args->filenames[i]);
+        free(args->dest_paths[i]);
+    }
+    free(args->filenames);
+    free(args->dest_paths);
+    args->filenames = NULL;
+    args->dest_paths = NULL;
+    args->file_count = 0;
+    args->file_capacity = 0;
+}
+
+// Add every path listed in a file. Entries are NUL separated if the list
+// contains a NUL byte, newline separated otherwise; empty entries are skipped.
+int collect_files_from_list(cli_args_adder_t* args, const char* list_path) {
+    uint64_t list_size;
+    uint8_t* list = read_file_content(list_path, &list_size);
+    if (!list) {
+        return -1;
+    }
+    
+    char separator = memchr(list, '\0', list_size) ? '\0' : '\n';
+    uint64_t start = 0;
+    for (uint64_t i = 0; i <= list_size; i++) {
+        if (i < list_size && list[i] != (uint8_t)separator) {
+            continue;
+        }
+        uint64_t len = i - start;
+        if (separator == '\n' && len > 0 && list[start + len - 1] == '\r') {
+            len--;
+        }
+        if (len > 0) {
+            char* path = malloc(len + 1);
+            if (!path) {
+                print_error("Cannot allocate memory for file list");
+                free(list);
+                return -1;
+            }
+            memcpy(path, list + start, len);
+            path[len] = '\0';
+            int rc = append_host_file(args, path);
+            free(path);
+            if (rc != 0) {
+                free(list);
+                return -1;
+            }
+        }
+        start = i + 1;
+    }
+    
+    free(list);
+    return 0;
+}
+
+int compare_names(const void* a, const void* b) {
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+// Add every regular file under a host directory, sorted by name within
+// each directory. Files keep their path below host_dir, under rel_dir in
+// the image; symbolic links to directories are not followed.
+int collect_files_from_dir(cli_args_adder_t* args, const char* host_dir, const char* rel_dir) {
+    DIR* dir = opendir(host_dir);
+    if (!dir) {
+        print_error("Cannot open directory %s: %s", host_dir, strerror(errno));
+        return -1;
+    }
+    
+    char** names = NULL;
+    size_t name_count = 0;
+    size_t name_capacity = 0;
+    int rc = 0;
+    struct dirent* entry;
+    while (rc == 0 && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (name_count == name_capacity) {
+            name_capacity = name_capacity ? name_capacity * 2 : 16;
+            char** grown = realloc(names, name_capacity * sizeof(char*));
+            if (!grown) {
+                rc = -1;
+                break;
+            }
+            names = grown;
+        }
+        names[name_count] = strdup(entry->d_name);
+        if (!names[name_count]) {
+            rc = -1;
+            break;
+        }
+        name_count++;
+    }
+    closedir(dir);
+    if (rc != 0) {
+        print_error("Cannot allocate memory for file list");
+    }
+    qsort(names, name_count, sizeof(char*), compare_names);
+    
+    for (size_t i = 0; i < name_count && rc == 0; i++) {
+        size_t host_len = strlen(host_dir) + 1 + strlen(names[i]) + 1;
+        size_t rel_len = strlen(rel_dir) + 1 + strlen(names[i]) + 1;
+        char* path = malloc(host_len);
+        char* rel = malloc(rel_len);
+        if (!path || !rel) {
+            print_error("Cannot allocate memory for file list");
+            free(path);
+            free(rel);
+            rc = -1;
+            break;
+        }
+        snprintf(path, host_len, "%s/%s", host_dir, names[i]);
+        snprintf(rel, rel_len, "%s/%s", rel_dir, names[i]);
+        
+        struct stat st;
+        if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            rc = collect_files_from_dir(args, path, rel);
+            free(path);
+        } else if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+            rc = append_filename(args, path, join_dest_path(args->dest_dir, rel));
+        } else {
+            free(path);
+        }
+        free(rel);
+    }
+    
+    for (size_t i = 0; i < name_count; i++) {
+        free(names[i]);
+    }
+    free(names);
+    return rc;
+}
 
 // Parse command line arguments
 int parse_cli_args(int argc, char* argv[], cli_args_adder_t* args) {
     args->input_image = NULL;
     args->output_image = NULL;
-    args->filename = NULL;
+    args->filenames = NULL;
+    args->dest_paths = NULL;
+    args->file_count = 0;
+    args->file_capacity = 0;
+    args->dest_dir = NULL;
+    args->parents = 0;
+    args->stats = 0;
     
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--input") == 0) {
@@ -27,7 +267,40 @@ int parse_cli_args(int argc, char* argv[], cli_args_adder_t* args) {
                 print_error("--file requires a filename");
                 return -1;
             }
-            args->filename = argv[++i];
+            if (append_host_file(args, argv[++i]) != 0) {
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "--files-from") == 0) {
+            if (i + 1 >= argc) {
+                print_error("--files-from requires a filename");
+                return -1;
+            }
+            if (collect_files_from_list(args, argv[++i]) != 0) {
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "--dir") == 0) {
+            if (i + 1 >= argc) {
+                print_error("--dir requires a directory");
+                return -1;
+            }
+            if (collect_files_from_dir(args, argv[++i], "") != 0) {
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "--dest") == 0) {
+            if (i + 1 >= argc) {
+                print_error("--dest requires a directory");
+                return -1;
+            }
+            args->dest_dir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--parents") == 0) {
+            args->parents = 1;
+        }
+        else if (strcmp(argv[i], "--stats") == 0) {
+            args->stats = 1;
         }
         else {
             print_error("Unknown argument %s", argv[i]);
@@ -45,317 +318,521 @@ int parse_cli_args(int argc, char* argv[], cli_args_adder_t* args) {
         return -1;
     }
     
-    if (!args->filename) {
-        print_error("--file is required");
-        return -1;
-    }
-    
-    // Validate filename length
-    const char* filename_only = extract_filename(args->filename);
-    if (strlen(filename_only) > 57) {
-        print_error("Filename too long (max 57 characters)");
+    if (args->file_count == 0) {
+        print_error("--file, --files-from or --dir must name at least one file");
         return -1;
     }
     
     return 0;
 }
 
+// Check whether input and output name the same existing image
+int is_same_image(const char* input_image, const char* output_image) {
+    struct stat in_st, out_st;
+    if (stat(input_image, &in_st) != 0 || stat(output_image, &out_st) != 0) {
+        return 0;
+    }
+    return in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino;
+}
 
-int main(int argc, char* argv[]) {
-    crc32_init();
-    
-    // Parse CLI arguments
-    cli_args_adder_t args;
-    if (parse_cli_args(argc, argv, &args) != 0) {
-        return 1;
+// Check that a host file can be stored in the image format under dest
+int check_file(pending_file_t* file, const char* path, const char* dest) {
+    memset(file, 0, sizeof(pending_file_t));
+    file->path = path;
+    file->dest = dest;
+    file->name = extract_filename(dest);
+    for (const char* part = dest; *part; ) {
+        size_t len = strcspn(part, "/");
+        if (len > DIRENT_NAME_MAX) {
+            print_error("Invalid name '%.*s' in %s (1 to %d characters)", (int)len, part, dest,
+                        DIRENT_NAME_MAX);
+            return -1;
+        }
+        part += len + (part[len] == '/');
     }
     
-    // Check if the file to be added exists
-    uint64_t file_size;
-    uint8_t* file_content = read_file_content(args.filename, &file_size);
-    if (!file_content) {
-        return 1;
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        print_error("Cannot open file %s: %s", path, strerror(errno));
+        return -1;
     }
-    
-    // Validate file size
-    if (file_size == 0) {
-        print_error("File is empty");
-        free(file_content);
-        return 1;
+    if (!S_ISREG(st.st_mode)) {
+        print_error("%s is not a regular file", path);
+        return -1;
     }
     
+    // Empty files take an inode and no blocks
+    file->size = (uint64_t)st.st_size;
+    
     // Calculate blocks needed for file
-    uint64_t blocks_needed = (file_size + BS - 1) / BS;  // Round up
-    if (blocks_needed > DIRECT_MAX) {
-        print_error("File too large (needs %lu blocks, max %d)", blocks_needed, DIRECT_MAX);
-        free(file_content);
-        return 1;
+    file->block_count = (file->size + BS - 1) / BS;  // Round up
+    if (file->block_count > FILE_MAX_BLOCKS) {
+        print_error("File %s too large (needs %" PRIu64 " blocks, max %" PRIu64 ")", path,
+                    file->block_count, (uint64_t)FILE_MAX_BLOCKS);
+        return -1;
     }
-    
-    // Open input image
-    FILE* input_file = fopen(args.input_image, "rb");
-    if (!input_file) {
-        print_error("Cannot open input image %s: %s", args.input_image, strerror(errno));
-        free(file_content);
-        return 1;
+    return 0;
+}
+
+// Data blocks a directory needs for its new entries, counting the first
+// block of a directory this run creates
+uint64_t dir_blocks_needed(fs_image_t* img, const pending_dir_t* dir) {
+    if (dir->inode_num == 0) {
+        int indexed = (img->sb->flags & FS_FLAG_DIR_INDEX) != 0;
+        return 1 + dir_growth_blocks(img->sb->flags, indexed, 1, indexed ? 0 : DIRENTS_PER_BLOCK - 2,
+                                     dir->entry_count);
     }
-    
-    // Read the superblock of the image
-    superblock_t sb;
-    uint8_t block_buffer[BS];
-    if (fread(block_buffer, BS, 1, input_file) != 1) {
-        print_error("Cannot read superblock");
-        fclose(input_file);
-        free(file_content);
-        return 1;
+    const inode_t* inode = image_inode(img, dir->inode_num);
+    return dir_growth_blocks(img->sb->flags, dir_is_indexed(img, inode), dir_block_count(img, inode),
+                             dir_free_slots(img, dir->inode_num), dir->entry_count);
+}
+
+// Make sure the whole batch fits before anything is modified
+int check_capacity(fs_image_t* img, const pending_file_t* files, size_t file_count,
+                   const pending_dir_t* dirs, size_t dir_count) {
+    uint64_t inodes_needed = file_count;
+    uint64_t blocks_needed = 0;
+    for (size_t i = 0; i < dir_count; i++) {
+        if (dirs[i].inode_num == 0) {
+            inodes_needed++;
+        }
+        blocks_needed += dir_blocks_needed(img, &dirs[i]);
     }
-    memcpy(&sb, block_buffer, sizeof(superblock_t));
-    
-    // Validate magic number
-    if (sb.magic != MAGIC_NUMBER) {
-        print_error("Invalid file system magic number");
-        fclose(input_file);
-        free(file_content);
-        return 1;
+    for (size_t i = 0; i < file_count; i++) {
+        blocks_needed += file_blocks_needed(img->sb->flags, files[i].size);
     }
     
-    // Read inode bitmap
-    uint8_t inode_bitmap[BS];
-    if (fread(inode_bitmap, BS, 1, input_file) != 1) {
-        print_error("Cannot read inode bitmap");
-        fclose(input_file);
-        free(file_content);
-        return 1;
+    uint64_t free_inodes = image_free_inode_count(img);
+    if (free_inodes < inodes_needed) {
+        print_error("Not enough free inodes (need %" PRIu64 ", have %" PRIu64 ")",
+                    inodes_needed, free_inodes);
+        return -1;
     }
     
-    // Read data bitmap
-    uint8_t data_bitmap[BS];
-    if (fread(data_bitmap, BS, 1, input_file) != 1) {
-        print_error("Cannot read data bitmap");
-        fclose(input_file);
-        free(file_content);
-        return 1;
+    uint64_t free_blocks = image_free_block_count(img);
+    if (free_blocks < blocks_needed) {
+        print_error("Not enough free data blocks (need %" PRIu64 ", have %" PRIu64 ")",
+                    blocks_needed, free_blocks);
+        return -1;
     }
-    
-    // Locate free inode
-    int free_inode_bit = find_free_bit(inode_bitmap, (uint32_t)sb.inode_count);
-    if (free_inode_bit < 0) {
-        print_error("No free inodes available");
-        fclose(input_file);
-        free(file_content);
-        return 1;
+    return 0;
+}
+
+int compare_dir_paths(const void* a, const void* b) {
+    return strcmp(((const pending_dir_t*)a)->path, ((const pending_dir_t*)b)->path);
+}
+
+int compare_file_dests(const void* a, const void* b) {
+    return strcmp((*(const pending_file_t* const*)a)->dest, (*(const pending_file_t* const*)b)->dest);
+}
+
+// Index of a directory in the sorted plan, or -1
+ssize_t find_pending_dir(const pending_dir_t* dirs, size_t dir_count, const char* path, size_t len) {
+    size_t lo = 0;
+    size_t hi = dir_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = strncmp(dirs[mid].path, path, len);
+        if (cmp == 0) {
+            cmp = dirs[mid].path[len] != '\0';
+        }
+        if (cmp == 0) {
+            return (ssize_t)mid;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
-    uint32_t new_inode_num = free_inode_bit + 1;  // Inodes are 1-indexed
-    
-    // Locate free data blocks
-    uint32_t data_blocks[DIRECT_MAX];
-    for (uint64_t i = 0; i < blocks_needed; i++) {
-        int free_data_bit = find_free_bit(data_bitmap, (uint32_t)sb.data_region_blocks);
-        if (free_data_bit < 0) {
-            print_error("Not enough free data blocks (need %lu)", blocks_needed);
-            fclose(input_file);
-            free(file_content);
-            return 1;
+    return -1;
+}
+
+// Length of the parent part of a path relative to the root ("" for a name
+// in the root)
+size_t parent_length(const char* path) {
+    const char* slash = strrchr(path, '/');
+    return slash ? (size_t)(slash - path) : 0;
+}
+
+void free_dir_plan(pending_dir_t* dirs, size_t dir_count) {
+    for (size_t i = 0; i < dir_count; i++) {
+        free(dirs[i].path);
+    }
+    free(dirs);
+}
+
+// Work out every directory the batch goes into, sorted by path so parents
+// come before their children: which exist in the image, which this run
+// creates and how many new entries each receives. Refuses names that are
+// already taken, given twice, or used as both a file and a directory.
+int plan_directories(fs_image_t* img, pending_file_t* files, size_t file_count,
+                     pending_dir_t** dirs_out, size_t* dir_count_out) {
+    // Every proper prefix of every destination, plus the root itself
+    size_t capacity = 1;
+    for (size_t i = 0; i < file_count; i++) {
+        for (const char* c = files[i].dest; *c; c++) {
+            capacity += *c == '/';
         }
-        data_blocks[i] = (uint32_t)sb.data_region_start + free_data_bit;
-        set_bit(data_bitmap, free_data_bit);
     }
-    
-    // Mark inode as used
-    set_bit(inode_bitmap, free_inode_bit);
-    
-    // Read inode table
-    uint8_t* inode_table = malloc(sb.inode_table_blocks * BS);
-    if (!inode_table) {
-        print_error("Cannot allocate memory for inode table");
-        fclose(input_file);
-        free(file_content);
-        return 1;
+    pending_dir_t* dirs = calloc(capacity, sizeof(pending_dir_t));
+    if (!dirs) {
+        print_error("Cannot allocate memory for directory list");
+        return -1;
     }
-    
-    if (fread(inode_table, BS, sb.inode_table_blocks, input_file) != sb.inode_table_blocks) {
-        print_error("Cannot read inode table");
-        fclose(input_file);
-        free(file_content);
-        free(inode_table);
-        return 1;
+    size_t dir_count = 0;
+    dirs[dir_count++].path = strdup("");
+    for (size_t i = 0; i < file_count; i++) {
+        for (const char* c = files[i].dest; *c; c++) {
+            if (*c == '/') {
+                dirs[dir_count++].path = strndup(files[i].dest, (size_t)(c - files[i].dest));
+            }
+        }
     }
-    
-    // Create new inode for the file
-    inode_t* new_inode = (inode_t*)(inode_table + (new_inode_num - 1) * INODE_SIZE);
-    memset(new_inode, 0, sizeof(inode_t));
-    
-    time_t now = time(NULL);
-    new_inode->mode = MODE_FILE;  // File mode
-    new_inode->links = 1;
-    new_inode->uid = 0;
-    new_inode->gid = 0;
-    new_inode->size_bytes = file_size;
-    new_inode->atime = (uint64_t)now;
-    new_inode->mtime = (uint64_t)now;
-    new_inode->ctime = (uint64_t)now;
-    
-    // Set the direct block pointers
-    for (uint64_t i = 0; i < blocks_needed; i++) {
-        new_inode->direct[i] = data_blocks[i];
-    }
-    for (uint64_t i = blocks_needed; i < DIRECT_MAX; i++) {
-        new_inode->direct[i] = 0;
-    }
-    
-    new_inode->reserved_0 = 0;
-    new_inode->reserved_1 = 0;
-    new_inode->reserved_2 = 0;
-    new_inode->proj_id = PROJ_ID;
-    new_inode->uid16_gid16 = 0;
-    new_inode->xattr_ptr = 0;
-    
-    inode_crc_finalize(new_inode);
-    
-    // Update root directory
-    inode_t* root_inode = (inode_t*)(inode_table + (ROOT_INO - 1) * INODE_SIZE);
-    root_inode->links++;  // Increment link count
-    root_inode->mtime = (uint64_t)now;
-    inode_crc_finalize(root_inode);
-    
-    // Read data region to update root directory
-    uint8_t* data_region = malloc(sb.data_region_blocks * BS);
-    if (!data_region) {
-        print_error("Cannot allocate memory for data region");
-        fclose(input_file);
-        free(file_content);
-        free(inode_table);
-        return 1;
+    for (size_t i = 0; i < dir_count; i++) {
+        if (!dirs[i].path) {
+            print_error("Cannot allocate memory for directory list");
+            free_dir_plan(dirs, dir_count);
+            return -1;
+        }
+    }
+    qsort(dirs, dir_count, sizeof(pending_dir_t), compare_dir_paths);
+    size_t unique = 0;
+    for (size_t i = 0; i < dir_count; i++) {
+        if (unique > 0 && strcmp(dirs[unique - 1].path, dirs[i].path) == 0) {
+            free(dirs[i].path);
+        } else {
+            dirs[unique++] = dirs[i];
+        }
+    }
+    dir_count = unique;
+    
+    // Find the directories that already exist; parents are resolved first
+    int rc = 0;
+    dirs[0].inode_num = ROOT_INO;
+    for (size_t i = 1; i < dir_count && rc == 0; i++) {
+        size_t len = parent_length(dirs[i].path);
+        dirs[i].parent = (size_t)find_pending_dir(dirs, dir_count, dirs[i].path, len);
+        pending_dir_t* parent = &dirs[dirs[i].parent];
+        parent->entry_count++;
+        if (parent->inode_num == 0) {
+            continue;
+        }
+        const char* name = dirs[i].path + len + (len > 0);
+        dirent64_t* entry = dir_lookup(img, parent->inode_num, name);
+        if (!entry) {
+            continue;
+        }
+        if (entry->type != FILE_TYPE_DIRECTORY || image_inode(img, entry->inode_no)->mode != MODE_DIR) {
+            print_error("%s exists in the image and is not a directory", dirs[i].path);
+            rc = -1;
+        }
+        dirs[i].inode_num = entry->inode_no;
     }
     
-    if (fread(data_region, BS, sb.data_region_blocks, input_file) != sb.data_region_blocks) {
-        print_error("Cannot read data region");
-        fclose(input_file);
-        free(file_content);
-        free(inode_table);
-        free(data_region);
-        return 1;
+    for (size_t i = 0; i < file_count && rc == 0; i++) {
+        files[i].parent = (size_t)find_pending_dir(dirs, dir_count, files[i].dest,
+                                                   parent_length(files[i].dest));
+        pending_dir_t* parent = &dirs[files[i].parent];
+        parent->entry_count++;
+        if (find_pending_dir(dirs, dir_count, files[i].dest, strlen(files[i].dest)) >= 0) {
+            print_error("%s would be both a file and a directory", files[i].dest);
+            rc = -1;
+        } else if (parent->inode_num != 0 && dir_lookup(img, parent->inode_num, files[i].name)) {
+            print_error("%s already exists in the image", files[i].dest);
+            rc = -1;
+        }
     }
     
-    fclose(input_file);
+    // The same destination twice in the batch
+    pending_file_t** sorted = rc == 0 ? malloc(file_count * sizeof(pending_file_t*)) : NULL;
+    if (rc == 0 && !sorted) {
+        print_error("Cannot allocate memory for file list");
+        rc = -1;
+    }
+    if (sorted) {
+        for (size_t i = 0; i < file_count; i++) {
+            sorted[i] = &files[i];
+        }
+        qsort(sorted, file_count, sizeof(pending_file_t*), compare_file_dests);
+        for (size_t i = 1; i < file_count && rc == 0; i++) {
+            if (strcmp(sorted[i - 1]->dest, sorted[i]->dest) == 0) {
+                print_error("%s and %s would both be stored as %s", sorted[i - 1]->path,
+                            sorted[i]->path, sorted[i]->dest);
+                rc = -1;
+            }
+        }
+        free(sorted);
+    }
     
-    // Find free directory entry in root directory
-    uint32_t root_data_block = root_inode->direct[0] - (uint32_t)sb.data_region_start;
-    uint8_t* root_dir_data = data_region + root_data_block * BS;
-    dirent64_t* entries = (dirent64_t*)root_dir_data;
+    if (rc != 0) {
+        free_dir_plan(dirs, dir_count);
+        return -1;
+    }
+    *dirs_out = dirs;
+    *dir_count_out = dir_count;
+    return 0;
+}
+
+// Allocate an inode and blocks for every planned directory that does not
+// exist yet, parents first, and for every file, without linking any of
+// them into a directory yet
+int allocate_batch(fs_image_t* img, pending_file_t* files, size_t file_count, pending_dir_t* dirs,
+                   size_t dir_count, time_t now) {
+    for (size_t i = 1; i < dir_count; i++) {
+        if (dirs[i].inode_num != 0) {
+            continue;
+        }
+        dirs[i].inode_num = dir_alloc(img, dirs[dirs[i].parent].inode_num, now);
+        if (dirs[i].inode_num == 0) {
+            print_error("Cannot create directory %s", dirs[i].path);
+            return -1;
+        }
+        dirs[i].created = 1;
+    }
+    for (size_t i = 0; i < file_count; i++) {
+        if (image_alloc_file(img, dirs[files[i].parent].inode_num, files[i].path, files[i].size, now,
+                             &files[i].copy) != 0) {
+            return -1;
+        }
+        files[i].inode_num = files[i].copy.inode_num;
+    }
+    return 0;
+}
+
+// Give back everything allocate_batch() took that is not linked in, from
+// the first unlinked file and directory on
+void release_batch(fs_image_t* img, pending_file_t* files, size_t file_count, size_t first_file,
+                   pending_dir_t* dirs, size_t dir_count, size_t first_dir) {
+    for (size_t i = file_count; i > first_file; i--) {
+        if (files[i - 1].inode_num != 0) {
+            image_release_file(img, &files[i - 1].copy);
+            files[i - 1].inode_num = 0;
+        }
+    }
+    for (size_t i = dir_count; i > first_dir; i--) {
+        if (dirs[i - 1].created && dirs[i - 1].inode_num != 0) {
+            dir_release(img, dirs[i - 1].inode_num);
+            dirs[i - 1].inode_num = 0;
+        }
+    }
+}
+
+// Link the new directories, parents first, and then the files into their
+// directories. Whatever cannot be linked is given back, so the image only
+// ever refers to complete files. Returns 0, or -1.
+int link_batch(fs_image_t* img, pending_file_t* files, size_t file_count, pending_dir_t* dirs,
+               size_t dir_count, time_t now) {
+    for (size_t i = 1; i < dir_count; i++) {
+        if (!dirs[i].created) {
+            continue;
+        }
+        const char* name = dirs[i].path + parent_length(dirs[i].path);
+        name += *name == '/';
+        if (dir_link(img, dirs[dirs[i].parent].inode_num, dirs[i].inode_num, name, now) != 0) {
+            print_error("Cannot create directory %s", dirs[i].path);
+            release_batch(img, files, file_count, 0, dirs, dir_count, i);
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < file_count; i++) {
+        if (dir_add_entry(img, dirs[files[i].parent].inode_num, files[i].inode_num, FILE_TYPE_REGULAR,
+                          files[i].name, now) != 0) {
+            print_error("Cannot add %s to the image as %s", files[i].path, files[i].dest);
+            release_batch(img, files, file_count, i, dirs, dir_count, dir_count);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Return nonzero if a buffer holds only zero bytes
+int is_zero_buffer(const uint8_t* buffer, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (buffer[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Copy the whole input image to a new output image. Runs of zeros are
+// skipped rather than written, so sparse images stay sparse.
+int copy_image(const char* input_image, const char* output_image) {
+    int in_fd = open(input_image, O_RDONLY);
+    if (in_fd < 0) {
+        print_error("Cannot open input image %s: %s", input_image, strerror(errno));
+        return -1;
+    }
+    int out_fd = open(output_image, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        print_error("Cannot create output image %s: %s", output_image, strerror(errno));
+        close(in_fd);
+        return -1;
+    }
     
-    // Find first free entry (skip . & .. at pos 0 and 1)
-    int free_entry_idx = -1;
-    int max_entries = (int)(BS / sizeof(dirent64_t));
-    for (int i = 2; i < max_entries; i++) {
-        if (entries[i].inode_no == 0) {
-            free_entry_idx = i;
+    uint8_t buffer[16 * BS];
+    off_t offset = 0;
+    int rc = 0;
+    for (;;) {
+        ssize_t n = read(in_fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            print_error("Cannot read input image: %s", strerror(errno));
+            rc = -1;
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        if (is_zero_buffer(buffer, (size_t)n)) {
+            offset += n;
+            continue;
+        }
+        ssize_t done = 0;
+        while (done < n) {
+            ssize_t w = pwrite(out_fd, buffer + done, (size_t)(n - done), offset + done);
+            if (w < 0 && errno == EINTR) {
+                continue;
+            }
+            if (w <= 0) {
+                break;
+            }
+            done += w;
+        }
+        if (done < n) {
+            print_error("Cannot write output image: %s", strerror(errno));
+            rc = -1;
             break;
         }
+        offset += n;
     }
     
-    if (free_entry_idx < 0) {
-        print_error("No free directory entries in root directory");
-        free(file_content);
-        free(inode_table);
-        free(data_region);
-        return 1;
+    // Extend over any trailing zeros
+    if (rc == 0 && ftruncate(out_fd, offset) != 0) {
+        print_error("Cannot size output image %s: %s", output_image, strerror(errno));
+        rc = -1;
     }
     
-    // Create new directory entry
-    dirent64_t* new_entry = &entries[free_entry_idx];
-    memset(new_entry, 0, sizeof(dirent64_t));
-    new_entry->inode_no = new_inode_num;
-    new_entry->type = FILE_TYPE_REGULAR;  // File
-    const char* filename_only = extract_filename(args.filename);
-    strncpy(new_entry->name, filename_only, 57);  
-    new_entry->name[57] = '\0';  
-    dirent_checksum_finalize(new_entry);
-    
-    // Update root inode size
-    root_inode->size_bytes += sizeof(dirent64_t);
-    inode_crc_finalize(root_inode);
-    
-    // Write file content to data blocks
-    for (uint64_t i = 0; i < blocks_needed; i++) {
-        uint32_t block_offset = data_blocks[i] - (uint32_t)sb.data_region_start;
-        uint8_t* block_data = data_region + block_offset * BS;
-        
-        uint64_t bytes_to_copy = (i == blocks_needed - 1) ? 
-            (file_size - i * BS) : BS;
-        
-        memset(block_data, 0, BS);  // Clear block first
-        memcpy(block_data, file_content + i * BS, bytes_to_copy);
+    close(in_fd);
+    if (close(out_fd) != 0 && rc == 0) {
+        print_error("Cannot close output image %s: %s", output_image, strerror(errno));
+        rc = -1;
     }
-    
-    free(file_content);
-    
-    // Update superblock timestamp
-    sb.mtime_epoch = (uint64_t)now;
-    superblock_crc_finalize(&sb);
-    
-    // Write the updated file system
-    FILE* output_file = fopen(args.output_image, "wb");
-    if (!output_file) {
-        print_error("Cannot create output image %s: %s", args.output_image, strerror(errno));
-        free(inode_table);
-        free(data_region);
+    return rc;
+}
+
+int main(int argc, char* argv[]) {
+    // Parse CLI arguments
+    cli_args_adder_t args;
+    if (parse_cli_args(argc, argv, &args) != 0) {
+        free_cli_args(&args);
         return 1;
     }
     
-    // Write superblock
-    memset(block_buffer, 0, BS);
-    memcpy(block_buffer, &sb, sizeof(superblock_t));
-    if (fwrite(block_buffer, BS, 1, output_file) != 1) {
-        print_error("Cannot write superblock");
-        fclose(output_file);
-        free(inode_table);
-        free(data_region);
+    // Validate every file before touching the image
+    pending_file_t* files = calloc(args.file_count, sizeof(pending_file_t));
+    if (!files) {
+        print_error("Cannot allocate memory for file list");
+        free_cli_args(&args);
         return 1;
     }
+    for (size_t i = 0; i < args.file_count; i++) {
+        if (check_file(&files[i], args.filenames[i], args.dest_paths[i]) != 0) {
+            free(files);
+            free_cli_args(&args);
+            return 1;
+        }
+    }
     
-    // Write inode bitmap
-    if (fwrite(inode_bitmap, BS, 1, output_file) != 1) {
-        print_error("Cannot write inode bitmap");
-        fclose(output_file);
-        free(inode_table);
-        free(data_region);
+    // Same image on both sides: modify it in place, otherwise work on a copy
+    int in_place = is_same_image(args.input_image, args.output_image);
+    if (!in_place && copy_image(args.input_image, args.output_image) != 0) {
+        unlink(args.output_image);
+        free(files);
+        free_cli_args(&args);
         return 1;
     }
     
-    // Write data bitmap
-    if (fwrite(data_bitmap, BS, 1, output_file) != 1) {
-        print_error("Cannot write data bitmap");
-        fclose(output_file);
-        free(inode_table);
-        free(data_region);
+    fs_image_t img;
+    if (image_open(&img, args.output_image, 1) != 0) {
+        if (!in_place) {
+            unlink(args.output_image);
+        }
+        free(files);
+        free_cli_args(&args);
         return 1;
     }
     
-    // Write inode table
-    if (fwrite(inode_table, BS, sb.inode_table_blocks, output_file) != sb.inode_table_blocks) {
-        print_error("Cannot write inode table");
-        fclose(output_file);
-        free(inode_table);
-        free(data_region);
+    pending_dir_t* dirs = NULL;
+    size_t dir_count = 0;
+    if (plan_directories(&img, files, args.file_count, &dirs, &dir_count) != 0 ||
+        check_capacity(&img, files, args.file_count, dirs, dir_count) != 0) {
+        free_dir_plan(dirs, dir_count);
+        image_close(&img);
+        if (!in_place) {
+            unlink(args.output_image);
+        }
+        free(files);
+        free_cli_args(&args);
         return 1;
     }
     
-    // Write data region
-    if (fwrite(data_region, BS, sb.data_region_blocks, output_file) != sb.data_region_blocks) {
-        print_error("Cannot write data region");
-        fclose(output_file);
-        free(inode_table);
-        free(data_region);
+    // Allocate everything in one pass and read every file before anything
+    // is linked in: if either step fails, all of it is given back and the
+    // image keeps its old contents, with only free blocks written to
+    time_t now = time(NULL);
+    int rc = allocate_batch(&img, files, args.file_count, dirs, dir_count, now);
+    for (size_t i = 0; i < args.file_count && rc == 0; i++) {
+        rc = file_copy_read(&img, &files[i].copy);
+    }
+    if (rc != 0) {
+        release_batch(&img, files, args.file_count, 0, dirs, dir_count, 0);
+    } else {
+        // Update superblock timestamp and allocation hints, even if linking
+        // stops part way and only some of the files are added
+        rc = link_batch(&img, files, args.file_count, dirs, dir_count, now);
+        image_update_superblock(&img, now);
+    }
+    for (size_t i = 0; i < args.file_count; i++) {
+        file_copy_free(&files[i].copy);
+    }
+    free_dir_plan(dirs, dir_count);
+    
+    // Report how full the image is after the additions
+    uint64_t inode_count = img.sb->inode_count;
+    uint64_t data_block_count = img.sb->data_region_blocks;
+    uint64_t free_inodes = image_free_inode_count(&img);
+    uint64_t free_blocks = image_free_block_count(&img);
+    uint64_t free_extent_count = image_free_extent_count(&img);
+    uint32_t largest_extent = image_largest_free_extent(&img);
+    
+    if (image_close(&img) != 0) {
+        rc = -1;
+    }
+    if (rc != 0) {
+        if (!in_place) {
+            unlink(args.output_image);
+        }
+        free(files);
+        free_cli_args(&args);
         return 1;
     }
     
-    fclose(output_file);
-    free(inode_table);
-    free(data_region);
-    
-    printf("Successfully added file '%s' to %s as %s\n", args.filename, args.output_image, filename_only);
-    printf("Assigned inode: %u\n", new_inode_num);
+    for (size_t i = 0; i < args.file_count; i++) {
+        printf("Successfully added file '%s' to %s as %s\n", files[i].path,
+               args.output_image, files[i].dest);
+        printf("Assigned inode: %u\n", files[i].inode_num);
+    }
+    if (args.stats) {
+        printf("Free inodes: %" PRIu64 "/%" PRIu64 ", free data blocks: %" PRIu64 "/%" PRIu64 "\n",
+               free_inodes, inode_count, free_blocks, data_block_count);
+        printf("Free space: %" PRIu64 " extent(s), largest %u block(s)\n", free_extent_count, largest_extent);
+    }
     
+    free(files);
+    free_cli_args(&args);
     return 0;
 }
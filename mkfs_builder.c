@@ -1,11 +1,54 @@
-// Build: gcc -O2 -std=c17 -Wall -Wextra mkfs_builder.c minivsfs_utils.c -o mkfs_builder
+// Build: make
 #include "minivsfs.h"
+#include <dirent.h>
+#include <pthread.h>
+
+#define MAX_JOBS 256
+
+// A host file or directory to store, in the order they are created. Entry
+// 0 is the --from-dir directory itself, which becomes the root.
+typedef struct {
+    char* path;                       // Path on the host
+    const char* name;                 // Last component of path
+    size_t parent;                    // Index of the parent directory
+    int is_dir;
+    uint64_t size;                    // File size, or entry count of a directory
+    uint32_t inode_num;
+    file_copy_t copy;                 // Blocks to read a file's content into
+} tree_entry_t;
+
+typedef struct {
+    tree_entry_t* entries;
+    size_t count;
+    size_t capacity;
+    uint64_t file_count;
+} host_tree_t;
+
+// Parse a decimal count, rejecting signs, junk and out-of-range values
+int parse_count(const char* text, uint64_t* value) {
+    if (*text < '0' || *text > '9') {
+        return -1;
+    }
+    char* end;
+    errno = 0;
+    unsigned long long parsed = strtoull(text, &end, 10);
+    if (errno != 0 || *end != '\0') {
+        return -1;
+    }
+    *value = (uint64_t)parsed;
+    return 0;
+}
 
 int parse_cli_args(int argc, char* argv[], cli_args_builder_t* args) {
     // Initialize defaults
     args->image_name = NULL;
     args->size_kib = 0;
     args->inode_count = 0;
+    args->alloc_mode = IMAGE_ALLOC_SPARSE;
+    args->flags = 0;
+    args->group_blocks = BITS_PER_BLOCK;
+    args->from_dir = NULL;
+    args->jobs = 1;
     
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--image") == 0) {
@@ -20,14 +63,76 @@ int parse_cli_args(int argc, char* argv[], cli_args_builder_t* args) {
                 print_error("--size-kib requires a value");
                 return -1;
             }
-            args->size_kib = (uint32_t)atoi(argv[++i]);
+            if (parse_count(argv[++i], &args->size_kib) != 0) {
+                print_error("Invalid --size-kib value %s", argv[i]);
+                return -1;
+            }
         }
         else if (strcmp(argv[i], "--inodes") == 0) {
             if (i + 1 >= argc) {
                 print_error("--inodes requires a value");
                 return -1;
             }
-            args->inode_count = (uint32_t)atoi(argv[++i]);
+            uint64_t inode_count;
+            if (parse_count(argv[++i], &inode_count) != 0 || inode_count > UINT32_MAX) {
+                print_error("Invalid --inodes value %s", argv[i]);
+                return -1;
+            }
+            args->inode_count = (uint32_t)inode_count;
+        }
+        else if (strcmp(argv[i], "--sparse") == 0) {
+            args->alloc_mode = IMAGE_ALLOC_SPARSE;
+        }
+        else if (strcmp(argv[i], "--no-sparse") == 0) {
+            args->alloc_mode = IMAGE_ALLOC_ZERO_FILL;
+        }
+        else if (strcmp(argv[i], "--preallocate") == 0) {
+            args->alloc_mode = IMAGE_ALLOC_PREALLOCATE;
+        }
+        else if (strcmp(argv[i], "--extents") == 0) {
+            args->flags |= FS_FLAG_EXTENTS;
+        }
+        else if (strcmp(argv[i], "--inline-data") == 0) {
+            args->flags |= FS_FLAG_INLINE_DATA;
+        }
+        else if (strcmp(argv[i], "--dir-index") == 0) {
+            args->flags |= FS_FLAG_DIR_INDEX;
+        }
+        else if (strcmp(argv[i], "--block-groups") == 0) {
+            args->flags |= FS_FLAG_BLOCK_GROUPS;
+        }
+        else if (strcmp(argv[i], "--group-blocks") == 0) {
+            if (i + 1 >= argc) {
+                print_error("--group-blocks requires a value");
+                return -1;
+            }
+            uint64_t group_blocks;
+            if (parse_count(argv[++i], &group_blocks) != 0 || group_blocks < 8 ||
+                group_blocks > UINT32_MAX) {
+                print_error("Invalid --group-blocks value %s", argv[i]);
+                return -1;
+            }
+            args->group_blocks = (uint32_t)group_blocks;
+            args->flags |= FS_FLAG_BLOCK_GROUPS;
+        }
+        else if (strcmp(argv[i], "--from-dir") == 0) {
+            if (i + 1 >= argc) {
+                print_error("--from-dir requires a directory");
+                return -1;
+            }
+            args->from_dir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--jobs") == 0) {
+            if (i + 1 >= argc) {
+                print_error("--jobs requires a value");
+                return -1;
+            }
+            uint64_t jobs;
+            if (parse_count(argv[++i], &jobs) != 0 || jobs < 1 || jobs > MAX_JOBS) {
+                print_error("Invalid --jobs value %s (1 to %d)", argv[i], MAX_JOBS);
+                return -1;
+            }
+            args->jobs = (uint32_t)jobs;
         }
         else {
             print_error("Unknown argument %s", argv[i]);
@@ -40,10 +145,15 @@ int parse_cli_args(int argc, char* argv[], cli_args_builder_t* args) {
         print_error("--image is required");
         return -1;
     }
-    
+    return 0;
+}
+
+// Check the image size and inode count, once --from-dir has filled in any
+// that were left out
+int validate_args(const cli_args_builder_t* args) {
     // Validate ranges
     if (args->size_kib < MIN_SIZE_KIB || args->size_kib > MAX_SIZE_KIB) {
-        print_error("--size-kib must be between %d and %d", MIN_SIZE_KIB, MAX_SIZE_KIB);
+        print_error("--size-kib must be between %d and %llu", MIN_SIZE_KIB, MAX_SIZE_KIB);
         return -1;
     }
     
@@ -59,12 +169,12 @@ int parse_cli_args(int argc, char* argv[], cli_args_builder_t* args) {
     }
     
     // Validate that inode count is reasonable for the given size
-    uint64_t total_blocks = (uint64_t)(args->size_kib * 1024) / BS;
+    uint64_t total_blocks = args->size_kib * 1024 / BS;
     uint32_t inodes_per_block = BS / INODE_SIZE;
     uint64_t max_inodes = total_blocks * inodes_per_block;
     
     if (args->inode_count > max_inodes) {
-        print_error("Too many inodes for the given size (max %lu)", max_inodes);
+        print_error("Too many inodes for the given size (max %" PRIu64 ")", max_inodes);
         return -1;
     }
     
@@ -74,26 +184,33 @@ int parse_cli_args(int argc, char* argv[], cli_args_builder_t* args) {
 // Calculate file system layout
 int calculate_layout(const cli_args_builder_t* args, fs_layout_t* layout) {
 
-    layout->total_blocks = (uint64_t)(args->size_kib * 1024) / BS;
+    layout->total_blocks = args->size_kib * 1024 / BS;
     uint32_t inodes_per_block = BS / INODE_SIZE;  
     layout->inode_table_blocks = (args->inode_count + inodes_per_block - 1) / inodes_per_block;
+    layout->inode_bitmap_blocks = (args->inode_count + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
     
-    // Fixed layout positions
+    // Layout positions: superblock, inode bitmap, data bitmap, inode table
     layout->superblock_start = 0;
     layout->inode_bitmap_start = 1;
-    layout->data_bitmap_start = 2;
-    layout->inode_table_start = 3;
-    layout->data_region_start = 3 + layout->inode_table_blocks;
-    
-    // Calculate data region blocks
-    layout->data_region_blocks = layout->total_blocks - layout->data_region_start;
-    
-    // Validate space
-    if (layout->data_region_blocks <= 0) {
+    uint64_t fixed_blocks = 1 + layout->inode_bitmap_blocks + layout->inode_table_blocks;
+    if (layout->total_blocks <= fixed_blocks + 1) {
         print_error("Not enough space for data region");
         return -1;
     }
     
+    // The data bitmap and the region it covers share the remaining blocks:
+    // each bitmap block maps BITS_PER_BLOCK data blocks, so the smallest
+    // count that covers the rest is ceil(remaining / (BITS_PER_BLOCK + 1))
+    uint64_t remaining = layout->total_blocks - fixed_blocks;
+    layout->data_bitmap_blocks = (remaining + BITS_PER_BLOCK) / (BITS_PER_BLOCK + 1);
+    layout->data_region_blocks = remaining - layout->data_bitmap_blocks;
+    
+    layout->data_bitmap_start = layout->inode_bitmap_start + layout->inode_bitmap_blocks;
+    layout->inode_table_start = layout->data_bitmap_start + layout->data_bitmap_blocks;
+    layout->data_region_start = layout->inode_table_start + layout->inode_table_blocks;
+    layout->inode_count = args->inode_count;
+    layout->group_count = 0;
+    
     if (layout->data_region_blocks < 1) {
         print_error("Need at least 1 data block for root directory");
         return -1;
@@ -102,6 +219,89 @@ int calculate_layout(const cli_args_builder_t* args, fs_layout_t* layout) {
     return 0;
 }
 
+// Calculate a block group layout: the superblock, the group descriptor
+// table, then groups of blocks_per_group blocks, each with a one-block inode
+// bitmap, a one-block data bitmap, its slice of the inode table and its data.
+// The layout fields describe group 0, except that data_region_blocks and
+// inode_count are totals over all groups.
+int calculate_group_layout(const cli_args_builder_t* args, fs_layout_t* layout) {
+    uint64_t total_blocks = args->size_kib * 1024 / BS;
+    uint64_t blocks_per_group = args->group_blocks;
+    uint32_t inodes_per_block = BS / INODE_SIZE;
+    
+    // Size the descriptor table for the most groups that could fit
+    uint64_t max_groups = (total_blocks - 1 + blocks_per_group - 1) / blocks_per_group;
+    uint64_t desc_blocks = (max_groups * sizeof(group_desc_t) + BS - 1) / BS;
+    uint64_t group_space = total_blocks - 1 - desc_blocks;
+    uint64_t group_count = (group_space + blocks_per_group - 1) / blocks_per_group;
+    
+    // Spread the inodes evenly, in whole inode table blocks, and drop a last
+    // group too small to hold its own metadata and a data block
+    uint64_t inodes_per_group = 0;
+    uint64_t table_blocks = 0;
+    while (group_count > 0) {
+        inodes_per_group = (args->inode_count + group_count - 1) / group_count;
+        inodes_per_group = (inodes_per_group + inodes_per_block - 1) / inodes_per_block * inodes_per_block;
+        table_blocks = inodes_per_group / inodes_per_block;
+        uint64_t last_group_blocks = group_space - (group_count - 1) * blocks_per_group;
+        if (last_group_blocks >= 2 + table_blocks + 1) {
+            break;
+        }
+        group_count--;
+        group_space = group_count * blocks_per_group;
+    }
+    if (group_count == 0) {
+        print_error("Not enough space for a block group");
+        return -1;
+    }
+    if (inodes_per_group > BITS_PER_BLOCK) {
+        print_error("Too many inodes per block group (%" PRIu64 ", max %u)", inodes_per_group,
+                    BITS_PER_BLOCK);
+        return -1;
+    }
+    if (blocks_per_group - 2 - table_blocks > BITS_PER_BLOCK) {
+        print_error("--group-blocks too large: a group's data bitmap covers at most %u blocks",
+                    BITS_PER_BLOCK);
+        return -1;
+    }
+    
+    layout->total_blocks = 1 + desc_blocks + group_space;
+    layout->group_count = (uint32_t)group_count;
+    layout->blocks_per_group = (uint32_t)blocks_per_group;
+    layout->inodes_per_group = (uint32_t)inodes_per_group;
+    layout->group_desc_blocks = desc_blocks;
+    layout->inode_count = group_count * inodes_per_group;
+    layout->inode_bitmap_blocks = 1;
+    layout->data_bitmap_blocks = 1;
+    layout->inode_table_blocks = table_blocks;
+    layout->superblock_start = 0;
+    layout->inode_bitmap_start = 1 + desc_blocks;
+    layout->data_bitmap_start = layout->inode_bitmap_start + 1;
+    layout->inode_table_start = layout->data_bitmap_start + 1;
+    layout->data_region_start = layout->inode_table_start + table_blocks;
+    layout->data_region_blocks = group_space - group_count * (2 + table_blocks);
+    return 0;
+}
+
+// Fill in the group descriptor table
+void create_group_descriptors(fs_image_t* img, const fs_layout_t* layout) {
+    uint64_t group_space_start = 1 + layout->group_desc_blocks;
+    for (uint32_t g = 0; g < layout->group_count; g++) {
+        group_desc_t* desc = image_group_desc(img, g);
+        uint64_t group_start = group_space_start + (uint64_t)g * layout->blocks_per_group;
+        uint64_t group_end = group_start + layout->blocks_per_group;
+        if (group_end > layout->total_blocks) {
+            group_end = layout->total_blocks;
+        }
+        memset(desc, 0, sizeof(group_desc_t));
+        desc->inode_bitmap_start = group_start;
+        desc->data_bitmap_start = group_start + 1;
+        desc->inode_table_start = group_start + 2;
+        desc->data_region_start = desc->inode_table_start + layout->inode_table_blocks;
+        desc->data_region_blocks = (uint32_t)(group_end - desc->data_region_start);
+    }
+}
+
 // Create superblock
 void create_superblock(superblock_t* sb, const cli_args_builder_t* args, const fs_layout_t* layout) {
     memset(sb, 0, sizeof(superblock_t));
@@ -112,173 +312,450 @@ void create_superblock(superblock_t* sb, const cli_args_builder_t* args, const f
     sb->version = VERSION;
     sb->block_size = BS;
     sb->total_blocks = layout->total_blocks;
-    sb->inode_count = args->inode_count;
+    sb->inode_count = layout->inode_count;
     sb->inode_bitmap_start = layout->inode_bitmap_start;
-    sb->inode_bitmap_blocks = 1;
+    sb->inode_bitmap_blocks = layout->inode_bitmap_blocks;
     sb->data_bitmap_start = layout->data_bitmap_start;
-    sb->data_bitmap_blocks = 1;
+    sb->data_bitmap_blocks = layout->data_bitmap_blocks;
     sb->inode_table_start = layout->inode_table_start;
     sb->inode_table_blocks = layout->inode_table_blocks;
     sb->data_region_start = layout->data_region_start;
     sb->data_region_blocks = layout->data_region_blocks;
     sb->root_inode = ROOT_INO;
     sb->mtime_epoch = (uint64_t)now;
-    sb->flags = 0;
+    sb->flags = args->flags;
+    sb->inode_alloc_hint = 1;         // Root inode and its directory block
+    sb->data_alloc_hint = 1;          // are already in use
+    sb->group_count = layout->group_count;
+    sb->blocks_per_group = layout->group_count ? layout->blocks_per_group : 0;
+    sb->inodes_per_group = layout->group_count ? layout->inodes_per_group : 0;
 
     superblock_crc_finalize(sb);
 }
 
-// Create root inode
-void create_root_inode(inode_t* root_inode, uint32_t first_data_block) {
-    memset(root_inode, 0, sizeof(inode_t));
+// Initialize the bitmaps of every group
+void initialize_bitmaps(fs_image_t* img) {
+    for (uint32_t g = 0; g < img->group_count; g++) {
+        fs_group_t* group = &img->groups[g];
+        uint64_t inode_bitmap_blocks = (group->inode_count + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+        uint64_t data_bitmap_blocks = (group->data_region_blocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+        memset(group->inode_bitmap, 0, inode_bitmap_blocks * BS);
+        memset(group->data_bitmap, 0, data_bitmap_blocks * BS);
+        image_mark_dirty(img, group->inode_bitmap_start, inode_bitmap_blocks);
+        image_mark_dirty(img, group->data_bitmap_start, data_bitmap_blocks);
+    }
     
-    time_t now = time(NULL);
+    // Mark root inode (inode #1) as used
+    img->groups[0].inode_bitmap[0] |= 0x01;
+    
+    // Mark first data block as used (for root directory)
+    img->groups[0].data_bitmap[0] |= 0x01;
+}
+
+// Append an entry to the tree, taking ownership of path. Returns its
+// index, or -1.
+ssize_t append_tree_entry(host_tree_t* tree, char* path, size_t parent, int is_dir, uint64_t size) {
+    if (tree->count == tree->capacity) {
+        size_t capacity = tree->capacity ? tree->capacity * 2 : 64;
+        tree_entry_t* grown = realloc(tree->entries, capacity * sizeof(tree_entry_t));
+        if (!grown) {
+            print_error("Cannot allocate memory for file list");
+            free(path);
+            return -1;
+        }
+        tree->entries = grown;
+        tree->capacity = capacity;
+    }
+    tree_entry_t* entry = &tree->entries[tree->count];
+    memset(entry, 0, sizeof(tree_entry_t));
+    entry->path = path;
+    entry->name = extract_filename(path);
+    entry->parent = parent;
+    entry->is_dir = is_dir;
+    entry->size = size;
+    if (tree->count > 0) {
+        tree->entries[parent].size++;
+    }
+    if (!is_dir) {
+        tree->file_count++;
+    }
+    return (ssize_t)tree->count++;
+}
+
+void free_host_tree(host_tree_t* tree) {
+    for (size_t i = 0; i < tree->count; i++) {
+        free(tree->entries[i].path);
+        file_copy_free(&tree->entries[i].copy);
+    }
+    free(tree->entries);
+    memset(tree, 0, sizeof(host_tree_t));
+}
+
+int compare_names(const void* a, const void* b) {
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+// Append everything below the host directory of entry dir_index, sorted by
+// name within each directory and depth first, so every directory comes
+// right before its contents. Regular files and directories are taken;
+// symbolic links to files are followed, those to directories are not, and
+// other file types are skipped.
+int scan_tree(host_tree_t* tree, size_t dir_index) {
+    const char* host_dir = tree->entries[dir_index].path;
+    DIR* dir = opendir(host_dir);
+    if (!dir) {
+        print_error("Cannot open directory %s: %s", host_dir, strerror(errno));
+        return -1;
+    }
+    
+    char** names = NULL;
+    size_t name_count = 0;
+    size_t name_capacity = 0;
+    int rc = 0;
+    struct dirent* entry;
+    while (rc == 0 && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (name_count == name_capacity) {
+            name_capacity = name_capacity ? name_capacity * 2 : 16;
+            char** grown = realloc(names, name_capacity * sizeof(char*));
+            if (!grown) {
+                rc = -1;
+                break;
+            }
+            names = grown;
+        }
+        names[name_count] = strdup(entry->d_name);
+        if (!names[name_count]) {
+            rc = -1;
+            break;
+        }
+        name_count++;
+    }
+    closedir(dir);
+    if (rc != 0) {
+        print_error("Cannot allocate memory for file list");
+    }
+    qsort(names, name_count, sizeof(char*), compare_names);
+    
+    for (size_t i = 0; i < name_count && rc == 0; i++) {
+        // The entries may have moved while the previous name was scanned
+        host_dir = tree->entries[dir_index].path;
+        size_t path_len = strlen(host_dir) + 1 + strlen(names[i]) + 1;
+        char* path = malloc(path_len);
+        if (!path) {
+            print_error("Cannot allocate memory for file list");
+            rc = -1;
+            break;
+        }
+        snprintf(path, path_len, "%s/%s", host_dir, names[i]);
+        if (strlen(names[i]) > DIRENT_NAME_MAX) {
+            print_error("Name of %s too long (max %d characters)", path, DIRENT_NAME_MAX);
+            free(path);
+            rc = -1;
+            break;
+        }
+        
+        struct stat st;
+        if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            ssize_t index = append_tree_entry(tree, path, dir_index, 1, 0);
+            rc = index < 0 ? -1 : scan_tree(tree, (size_t)index);
+        } else if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+            if (((uint64_t)st.st_size + BS - 1) / BS > FILE_MAX_BLOCKS) {
+                print_error("File %s too large (max %" PRIu64 " blocks)", path,
+                            (uint64_t)FILE_MAX_BLOCKS);
+                free(path);
+                rc = -1;
+            } else {
+                rc = append_tree_entry(tree, path, dir_index, 0, (uint64_t)st.st_size) < 0 ? -1 : 0;
+            }
+        } else {
+            free(path);
+        }
+    }
     
-    root_inode->mode = MODE_DIR;  
-    root_inode->links = 2;       // . & .. 
-    root_inode->uid = 0;
-    root_inode->gid = 0;
-    root_inode->size_bytes = 2 * sizeof(dirent64_t);  // . & ..
-    root_inode->atime = (uint64_t)now;
-    root_inode->mtime = (uint64_t)now;
-    root_inode->ctime = (uint64_t)now;
-    root_inode->direct[0] = first_data_block;  
-    for (int i = 1; i < DIRECT_MAX; i++) {
-        root_inode->direct[i] = 0;  // Unused blocks
-    }
-    root_inode->reserved_0 = 0;
-    root_inode->reserved_1 = 0;
-    root_inode->reserved_2 = 0;
-    root_inode->proj_id = PROJ_ID; 
-    root_inode->uid16_gid16 = 0;
-    root_inode->xattr_ptr = 0;
-    
-    inode_crc_finalize(root_inode);
+    for (size_t i = 0; i < name_count; i++) {
+        free(names[i]);
+    }
+    free(names);
+    return rc;
 }
 
-// Create root directory entries . & ..
-void create_root_directory_entries(dirent64_t* dot_entry, dirent64_t* dotdot_entry) {
-    // "." entry
-    memset(dot_entry, 0, sizeof(dirent64_t));
-    dot_entry->inode_no = ROOT_INO;
-    dot_entry->type = FILE_TYPE_DIRECTORY;  
-    strcpy(dot_entry->name, ".");
-    dirent_checksum_finalize(dot_entry);  
-    
-    // ".." entry
-    memset(dotdot_entry, 0, sizeof(dirent64_t));
-    dotdot_entry->inode_no = ROOT_INO;
-    dotdot_entry->type = FILE_TYPE_DIRECTORY;  
-    strcpy(dotdot_entry->name, "..");
-    dirent_checksum_finalize(dotdot_entry);  
+// Blocks a directory of entry_count entries is given when it is created:
+// all it needs if it is linear, or the fewest leaves that could hold the
+// entries if it is indexed, which grows further as its leaves split
+uint64_t tree_dir_blocks(uint32_t flags, uint64_t entry_count) {
+    if (flags & FS_FLAG_DIR_INDEX) {
+        return 1 + (entry_count + DIRENTS_PER_BLOCK - 1) / DIRENTS_PER_BLOCK;
+    }
+    return (entry_count + 2 + DIRENTS_PER_BLOCK - 1) / DIRENTS_PER_BLOCK;
+}
+
+// Data blocks the whole tree takes at most on an image with these features
+uint64_t tree_data_blocks(const host_tree_t* tree, uint32_t flags) {
+    uint64_t blocks = 0;
+    for (size_t i = 0; i < tree->count; i++) {
+        const tree_entry_t* entry = &tree->entries[i];
+        if (!entry->is_dir) {
+            blocks += file_blocks_needed(flags, entry->size);
+        } else if (flags & FS_FLAG_DIR_INDEX) {
+            blocks += 1 + dir_growth_blocks(flags, 1, 1, 0, entry->size);
+        } else {
+            uint64_t dir_blocks = tree_dir_blocks(flags, entry->size);
+            blocks += dir_blocks + ((flags & FS_FLAG_EXTENTS) ? (dir_blocks > INODE_EXTENTS ? 1 : 0) :
+                                                               inode_map_blocks(dir_blocks));
+        }
+    }
+    return blocks;
 }
 
-// Initialize bitmaps
-void initialize_bitmaps(uint8_t* inode_bitmap, uint8_t* data_bitmap, uint32_t inode_count, uint64_t data_blocks) {
-    (void)inode_count;  // Suppress unused parameter warning
-    (void)data_blocks;  // Suppress unused parameter warning
+// Fill in the inode count and image size left out with --from-dir: enough
+// inodes for the tree, and the smallest image whose data region holds it
+int size_for_tree(cli_args_builder_t* args, const host_tree_t* tree) {
+    uint32_t inodes_per_block = BS / INODE_SIZE;
+    if (args->inode_count == 0) {
+        uint64_t inode_count = (tree->count + inodes_per_block - 1) / inodes_per_block * inodes_per_block;
+        if (inode_count > MAX_INODES) {
+            print_error("Too many files in %s (max %d inodes)", args->from_dir, MAX_INODES);
+            return -1;
+        }
+        args->inode_count = inode_count < MIN_INODES ? MIN_INODES : (uint32_t)inode_count;
+    }
+    if (args->size_kib != 0) {
+        return 0;
+    }
     
-    memset(inode_bitmap, 0, BS);
-    memset(data_bitmap, 0, BS);
+    // Start from the flat layout's metadata and grow by the shortfall until
+    // the data region is large enough
+    uint64_t data_blocks = tree_data_blocks(tree, args->flags);
+    uint64_t total_blocks = 1 + (args->inode_count + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK +
+                            (args->inode_count + inodes_per_block - 1) / inodes_per_block +
+                            data_blocks + data_blocks / BITS_PER_BLOCK + 2;
+    int grouped = (args->flags & FS_FLAG_BLOCK_GROUPS) != 0;
+    if (grouped) {
+        // Enough groups for each group's inodes to fit one bitmap block
+        uint64_t group_count = (args->inode_count + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+        uint64_t min_blocks = 1 + (group_count * sizeof(group_desc_t) + BS - 1) / BS +
+                              group_count * args->group_blocks;
+        if (total_blocks < min_blocks) {
+            total_blocks = min_blocks;
+        }
+    }
+    for (;;) {
+        args->size_kib = total_blocks * (BS / 1024);
+        if (args->size_kib < MIN_SIZE_KIB) {
+            args->size_kib = MIN_SIZE_KIB;
+        }
+        if (args->size_kib > MAX_SIZE_KIB) {
+            return 0;  // Reported by validate_args()
+        }
+        fs_layout_t layout;
+        int rc = grouped ? calculate_group_layout(args, &layout) : calculate_layout(args, &layout);
+        if (rc != 0) {
+            return -1;
+        }
+        if (layout.data_region_blocks >= data_blocks) {
+            return 0;
+        }
+        total_blocks = args->size_kib * 1024 / BS + (data_blocks - layout.data_region_blocks);
+    }
+}
+
+// Check that the tree fits the layout before the image is created
+int check_tree_fits(const cli_args_builder_t* args, const fs_layout_t* layout, const host_tree_t* tree) {
+    if (layout->inode_count < tree->count) {
+        print_error("Not enough inodes for %s (need %zu, have %" PRIu64 ")", args->from_dir,
+                    tree->count, layout->inode_count);
+        return -1;
+    }
+    uint64_t data_blocks = tree_data_blocks(tree, args->flags);
+    if (layout->data_region_blocks < data_blocks) {
+        print_error("Not enough data blocks for %s (need %" PRIu64 ", have %" PRIu64 ")",
+                    args->from_dir, data_blocks, layout->data_region_blocks);
+        return -1;
+    }
+    return 0;
+}
+
+// Create the scanned tree below the root, in traversal order. Each
+// directory gets its blocks when it is created, and on the empty image
+// every file's data follows the previous file's, so the image is written
+// front to back with every block written once. File contents are read
+// afterwards by copy_tree_files().
+int populate_tree(fs_image_t* img, host_tree_t* tree, time_t now) {
+    uint32_t flags = img->sb->flags;
+    tree->entries[0].inode_num = ROOT_INO;
+    if (dir_reserve(img, ROOT_INO, tree_dir_blocks(flags, tree->entries[0].size)) != 0) {
+        print_error("Not enough free data blocks for %s", tree->entries[0].path);
+        return -1;
+    }
     
-    // Mark root inode (inode #1) as used
-    inode_bitmap[0] |= 0x01;
+    for (size_t i = 1; i < tree->count; i++) {
+        tree_entry_t* entry = &tree->entries[i];
+        uint32_t parent_ino = tree->entries[entry->parent].inode_num;
+        if (!entry->is_dir) {
+            if (image_alloc_file(img, parent_ino, entry->path, entry->size, now, &entry->copy) != 0) {
+                return -1;
+            }
+            if (dir_add_entry(img, parent_ino, entry->copy.inode_num, FILE_TYPE_REGULAR, entry->name,
+                              now) != 0) {
+                print_error("Cannot add %s to the image", entry->path);
+                image_release_file(img, &entry->copy);
+                return -1;
+            }
+            entry->inode_num = entry->copy.inode_num;
+            continue;
+        }
+        entry->inode_num = dir_create(img, parent_ino, entry->name, now);
+        if (entry->inode_num == 0 ||
+            dir_reserve(img, entry->inode_num, tree_dir_blocks(flags, entry->size)) != 0) {
+            print_error("Cannot create directory for %s", entry->path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Work shared by the copy threads. Entries are claimed one at a time
+// through an atomic counter; all allocation is done before the threads
+// start, so each one only writes the blocks and inode of its own files.
+typedef struct {
+    fs_image_t* img;
+    host_tree_t* tree;
+    size_t next_entry;
+    int failed;
+} copy_pool_t;
+
+void* copy_worker(void* arg) {
+    copy_pool_t* pool = (copy_pool_t*)arg;
+    while (!__atomic_load_n(&pool->failed, __ATOMIC_RELAXED)) {
+        size_t i = __atomic_fetch_add(&pool->next_entry, 1, __ATOMIC_RELAXED);
+        if (i >= pool->tree->count) {
+            break;
+        }
+        tree_entry_t* entry = &pool->tree->entries[i];
+        if (!entry->is_dir && file_copy_read(pool->img, &entry->copy) != 0) {
+            __atomic_store_n(&pool->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+// Read every file's content into its blocks with jobs threads, the
+// calling thread being one of them. Files are claimed in traversal order,
+// which is also block order, so the image is still filled front to back.
+int copy_tree_files(fs_image_t* img, host_tree_t* tree, uint32_t jobs) {
+    copy_pool_t pool = { img, tree, 1, 0 };
+    pthread_t* threads = calloc(jobs, sizeof(pthread_t));
+    if (!threads) {
+        print_error("Cannot allocate memory for %u jobs", jobs);
+        return -1;
+    }
     
-    // Mark first data block as used (for root directory)
-    data_bitmap[0] |= 0x01;
+    // Carry on with fewer threads if some cannot be started
+    uint32_t started = 0;
+    while (started + 1 < jobs && pthread_create(&threads[started], NULL, copy_worker, &pool) == 0) {
+        started++;
+    }
+    copy_worker(&pool);
+    for (uint32_t t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+    return pool.failed ? -1 : 0;
 }
 
 int main(int argc, char* argv[]) {
-    crc32_init();
-    
     // Parse command line arguments
     cli_args_builder_t args;
     if (parse_cli_args(argc, argv, &args) != 0) {
         return 1;
     }
     
-    fs_layout_t layout;
-    if (calculate_layout(&args, &layout) != 0) {
-        return 1;
+    // With --from-dir, scan the whole tree first to size the image for it
+    host_tree_t tree = {0};
+    if (args.from_dir) {
+        char* root_path = strdup(args.from_dir);
+        if (!root_path || append_tree_entry(&tree, root_path, 0, 1, 0) < 0 ||
+            scan_tree(&tree, 0) != 0 || size_for_tree(&args, &tree) != 0) {
+            free_host_tree(&tree);
+            return 1;
+        }
     }
-    
-    FILE* img_file = fopen(args.image_name, "wb");
-    if (!img_file) {
-        print_error("Cannot create image file %s: %s", args.image_name, strerror(errno));
+    if (validate_args(&args) != 0) {
+        free_host_tree(&tree);
         return 1;
     }
     
-    // Create superblock
-    superblock_t superblock;
-    create_superblock(&superblock, &args, &layout);
-    
-    uint8_t block_buffer[BS];
-    memset(block_buffer, 0, BS);
-    memcpy(block_buffer, &superblock, sizeof(superblock_t));
-    if (fwrite(block_buffer, BS, 1, img_file) != 1) {
-        print_error("Error writing superblock");
-        fclose(img_file);
+    fs_layout_t layout;
+    int layout_rc = (args.flags & FS_FLAG_BLOCK_GROUPS) ? calculate_group_layout(&args, &layout) :
+                                                          calculate_layout(&args, &layout);
+    if (layout_rc != 0 || (args.from_dir && check_tree_fits(&args, &layout, &tree) != 0)) {
+        free_host_tree(&tree);
         return 1;
     }
     
-    // Initialize bitmaps
-    uint8_t inode_bitmap[BS];
-    uint8_t data_bitmap[BS];
-    initialize_bitmaps(inode_bitmap, data_bitmap, args.inode_count, layout.data_region_blocks);
-    
-    if (fwrite(inode_bitmap, BS, 1, img_file) != 1) {
-        print_error("Error writing inode bitmap");
-        fclose(img_file);
+    fs_image_t img;
+    if (image_create(&img, args.image_name, layout.total_blocks, args.alloc_mode) != 0) {
+        free_host_tree(&tree);
         return 1;
     }
     
-    // Write data bitmap
-    if (fwrite(data_bitmap, BS, 1, img_file) != 1) {
-        print_error("Error writing data bitmap");
-        fclose(img_file);
+    // Create superblock and, for a grouped layout, the group descriptors
+    create_superblock(img.sb, &args, &layout);
+    create_group_descriptors(&img, &layout);
+    if (image_attach_views(&img) != 0) {
+        image_close(&img);
+        free_host_tree(&tree);
         return 1;
     }
     
-    // Create inode table
-    for (uint64_t block = 0; block < layout.inode_table_blocks; block++) {
-        memset(block_buffer, 0, BS);
-        
-        if (block == 0) {
-            // First block contains root inode
-            inode_t root_inode;
-            uint32_t first_data_block = (uint32_t)layout.data_region_start;
-            create_root_inode(&root_inode, first_data_block);
-            memcpy(block_buffer, &root_inode, sizeof(inode_t));
-        }
-        
-        if (fwrite(block_buffer, BS, 1, img_file) != 1) {
-            print_error("Error writing inode table block %" PRIu64, block);
-            fclose(img_file);
-            return 1;
-        }
-    }
+    // Initialize bitmaps
+    initialize_bitmaps(&img);
+    image_update_group_descs(&img);
     
-    // Write data region
-    for (uint64_t block = 0; block < layout.data_region_blocks; block++) {
-        memset(block_buffer, 0, BS);
-        
-        if (block == 0) {
-            // First data block contains root directory entries
-            dirent64_t dot_entry, dotdot_entry;
-            create_root_directory_entries(&dot_entry, &dotdot_entry);
-            memcpy(block_buffer, &dot_entry, sizeof(dirent64_t));
-            memcpy(block_buffer + sizeof(dirent64_t), &dotdot_entry, sizeof(dirent64_t));
+    // First inode table block contains root inode, first data block its
+    // . & .. entries (both pointing at the root itself)
+    time_t now = time(NULL);
+    uint32_t first_data_block = (uint32_t)layout.data_region_start;
+    dir_init(&img, image_inode(&img, ROOT_INO), ROOT_INO, ROOT_INO, first_data_block, now);
+    
+    // The rest of the image stays zero; write back only what was filled in
+    image_mark_dirty(&img, layout.superblock_start, 1);
+    image_mark_dirty(&img, layout.inode_table_start, 1);
+    
+    int rc = 0;
+    if (args.from_dir) {
+        // Allocate from the fresh bitmaps like mkfs_adder does on an open image
+        img.inode_alloc_hint = img.sb->inode_alloc_hint;
+        img.data_alloc_hint = img.sb->data_alloc_hint;
+        rc = image_build_indexes(&img);
+        if (rc == 0) {
+            rc = populate_tree(&img, &tree, now);
         }
-        
-        if (fwrite(block_buffer, BS, 1, img_file) != 1) {
-            print_error("Error writing data block %" PRIu64, block);
-            fclose(img_file);
-            return 1;
+        if (rc == 0) {
+            rc = copy_tree_files(&img, &tree, args.jobs);
         }
+        image_update_superblock(&img, now);
     }
     
-    fclose(img_file);
+    if (image_close(&img) != 0) {
+        print_error("Error writing image %s", args.image_name);
+        rc = -1;
+    }
+    if (rc != 0) {
+        unlink(args.image_name);
+        free_host_tree(&tree);
+        return 1;
+    }
     printf("Successfully created image: %s\n", args.image_name);
+    if (args.from_dir) {
+        printf("Copied %" PRIu64 " file(s) and %zu director(ies) from %s (%" PRIu64 " KiB, %u inodes)\n",
+               tree.file_count, tree.count - 1 - (size_t)tree.file_count, args.from_dir,
+               args.size_kib, args.inode_count);
+    }
     
+    free_host_tree(&tree);
     return 0;
 }
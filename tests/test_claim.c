@@ -0,0 +1,270 @@
+// Concurrent allocator test: several threads claim every free inode and
+// data block of an image, then give them all back. Checks that no bit is
+// handed out twice, that only free bits are handed out, that nothing free
+// is left behind and that releasing restores the bitmaps exactly.
+//
+// Usage: test_claim <image>
+
+#include "test_common.h"
+#include <pthread.h>
+
+#define CLAIM_THREADS 8
+#define CLAIM_MAX_RUN 37   // Block runs asked for cycle through 1..CLAIM_MAX_RUN
+
+typedef struct {
+    fs_image_t* img;
+    uint32_t thread;
+    uint32_t* inodes;                 // Inodes this thread holds
+    size_t inode_count;
+    size_t inode_capacity;
+    extent_t* runs;                   // Block runs this thread holds, absolute
+    size_t run_count;
+    size_t run_capacity;
+    int failed;
+} claim_thread_t;
+
+static int push_inode(claim_thread_t* ct, uint32_t inode_num) {
+    if (ct->inode_count == ct->inode_capacity) {
+        size_t capacity = ct->inode_capacity ? ct->inode_capacity * 2 : 256;
+        uint32_t* inodes = realloc(ct->inodes, capacity * sizeof(uint32_t));
+        if (!inodes) {
+            return -1;
+        }
+        ct->inodes = inodes;
+        ct->inode_capacity = capacity;
+    }
+    ct->inodes[ct->inode_count++] = inode_num;
+    return 0;
+}
+
+static int push_run(claim_thread_t* ct, uint32_t start, uint32_t length) {
+    if (ct->run_count == ct->run_capacity) {
+        size_t capacity = ct->run_capacity ? ct->run_capacity * 2 : 256;
+        extent_t* runs = realloc(ct->runs, capacity * sizeof(extent_t));
+        if (!runs) {
+            return -1;
+        }
+        ct->runs = runs;
+        ct->run_capacity = capacity;
+    }
+    ct->runs[ct->run_count].start = start;
+    ct->runs[ct->run_count].length = length;
+    ct->run_count++;
+    return 0;
+}
+
+// Claim until the image is full. Every fifth inode and seventh run is given
+// straight back, so releases race with other threads' claims.
+static void* claim_worker(void* arg) {
+    claim_thread_t* ct = arg;
+    alloc_cursor_t cursor;
+    alloc_cursor_init(ct->img, &cursor, ct->thread, CLAIM_THREADS);
+    
+    uint64_t claims = 0;
+    for (;;) {
+        uint32_t inode_num = image_claim_inode(ct->img, &cursor);
+        if (inode_num == 0) {
+            break;
+        }
+        if (++claims % 5 == 0) {
+            image_unclaim_inode(ct->img, inode_num);
+        } else if (push_inode(ct, inode_num) != 0) {
+            ct->failed = 1;
+            return NULL;
+        }
+    }
+    
+    claims = 0;
+    for (;;) {
+        uint32_t want = 1 + (uint32_t)(claims % CLAIM_MAX_RUN);
+        uint32_t claimed = 0;
+        uint32_t first = image_claim_blocks(ct->img, &cursor, want, &claimed);
+        if (first == 0) {
+            break;
+        }
+        if (claimed == 0 || claimed > want) {
+            ct->failed = 1;
+            return NULL;
+        }
+        if (++claims % 7 == 0) {
+            image_unclaim_blocks(ct->img, first, claimed);
+        } else if (push_run(ct, first, claimed) != 0) {
+            ct->failed = 1;
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+// Give back everything this thread holds
+static void* release_worker(void* arg) {
+    claim_thread_t* ct = arg;
+    for (size_t i = 0; i < ct->inode_count; i++) {
+        image_unclaim_inode(ct->img, ct->inodes[i]);
+    }
+    for (size_t i = 0; i < ct->run_count; i++) {
+        image_unclaim_blocks(ct->img, ct->runs[i].start, ct->runs[i].length);
+    }
+    return NULL;
+}
+
+static int run_threads(claim_thread_t* threads, void* (*worker)(void*)) {
+    pthread_t ids[CLAIM_THREADS];
+    uint32_t started = 0;
+    for (; started < CLAIM_THREADS; started++) {
+        if (pthread_create(&ids[started], NULL, worker, &threads[started]) != 0) {
+            break;
+        }
+    }
+    for (uint32_t t = 0; t < started; t++) {
+        pthread_join(ids[t], NULL);
+    }
+    return started == CLAIM_THREADS ? 0 : -1;
+}
+
+static int bit_is_set(const uint8_t* bitmap, uint32_t bit) {
+    return (bitmap[bit / 8] >> (bit % 8)) & 1;
+}
+
+// Copy of every group's bitmaps, to compare against after releasing
+static uint8_t* snapshot_bitmaps(fs_image_t* img, size_t* size) {
+    *size = 0;
+    for (uint32_t g = 0; g < img->group_count; g++) {
+        *size += (img->groups[g].inode_count + 7) / 8 + (img->groups[g].data_region_blocks + 7) / 8;
+    }
+    uint8_t* copy = malloc(*size ? *size : 1);
+    if (!copy) {
+        return NULL;
+    }
+    uint8_t* next = copy;
+    for (uint32_t g = 0; g < img->group_count; g++) {
+        fs_group_t* group = &img->groups[g];
+        memcpy(next, group->inode_bitmap, (group->inode_count + 7) / 8);
+        next += (group->inode_count + 7) / 8;
+        memcpy(next, group->data_bitmap, (group->data_region_blocks + 7) / 8);
+        next += (group->data_region_blocks + 7) / 8;
+    }
+    return copy;
+}
+
+// Whether a data block was free before the threads started, and in range
+static int block_was_free(fs_image_t* img, const uint8_t* snapshot, uint64_t block) {
+    const uint8_t* next = snapshot;
+    for (uint32_t g = 0; g < img->group_count; g++) {
+        fs_group_t* group = &img->groups[g];
+        next += (group->inode_count + 7) / 8;
+        if (block >= group->data_region_start && block < group->data_region_start + group->data_region_blocks) {
+            return !bit_is_set(next, (uint32_t)(block - group->data_region_start));
+        }
+        next += (group->data_region_blocks + 7) / 8;
+    }
+    return 0;
+}
+
+static int inode_was_free(fs_image_t* img, const uint8_t* snapshot, uint32_t inode_num) {
+    const uint8_t* next = snapshot;
+    for (uint32_t g = 0; g < img->group_count; g++) {
+        fs_group_t* group = &img->groups[g];
+        if (inode_num >= group->first_inode && inode_num - group->first_inode < group->inode_count) {
+            return !bit_is_set(next, inode_num - group->first_inode);
+        }
+        next += (group->inode_count + 7) / 8 + (group->data_region_blocks + 7) / 8;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <image>\n", argv[0]);
+        return 2;
+    }
+    fs_image_t img;
+    if (image_open(&img, argv[1], 1) != 0) {
+        return 1;
+    }
+    
+    uint64_t free_inodes = image_free_inode_count(&img);
+    uint64_t free_blocks = image_free_block_count(&img);
+    size_t snapshot_size;
+    uint8_t* snapshot = snapshot_bitmaps(&img, &snapshot_size);
+    uint8_t* inode_owner = calloc(img.sb->inode_count + 1, 1);
+    uint8_t* block_owner = calloc(img.total_blocks, 1);
+    claim_thread_t threads[CLAIM_THREADS];
+    memset(threads, 0, sizeof(threads));
+    for (uint32_t t = 0; t < CLAIM_THREADS; t++) {
+        threads[t].img = &img;
+        threads[t].thread = t;
+    }
+    if (!snapshot || !inode_owner || !block_owner) {
+        print_error("Cannot allocate memory for the test");
+        return 1;
+    }
+    
+    // Claim everything from all threads at once
+    CHECK(image_concurrent_begin(&img) == 0, "cannot start concurrent allocation");
+    CHECK(run_threads(threads, claim_worker) == 0, "cannot start claim threads");
+    CHECK(image_concurrent_end(&img) == 0, "cannot rebuild indexes");
+    
+    uint64_t claimed_inodes = 0;
+    uint64_t claimed_blocks = 0;
+    for (uint32_t t = 0; t < CLAIM_THREADS; t++) {
+        claim_thread_t* ct = &threads[t];
+        CHECK(!ct->failed, "thread %u failed", t);
+        for (size_t i = 0; i < ct->inode_count; i++) {
+            uint32_t inode_num = ct->inodes[i];
+            CHECK(inode_was_free(&img, snapshot, inode_num), "inode %u was not free", inode_num);
+            CHECK(inode_owner[inode_num] == 0, "inode %u claimed twice", inode_num);
+            inode_owner[inode_num] = 1;
+            claimed_inodes++;
+        }
+        for (size_t i = 0; i < ct->run_count; i++) {
+            for (uint32_t b = 0; b < ct->runs[i].length; b++) {
+                uint64_t block = (uint64_t)ct->runs[i].start + b;
+                CHECK(block_was_free(&img, snapshot, block), "block %" PRIu64 " was not free", block);
+                CHECK(block < img.total_blocks && block_owner[block] == 0,
+                      "block %" PRIu64 " claimed twice", block);
+                if (block < img.total_blocks) {
+                    block_owner[block] = 1;
+                }
+                claimed_blocks++;
+            }
+        }
+    }
+    CHECK(claimed_inodes == free_inodes, "claimed %" PRIu64 " of %" PRIu64 " free inodes",
+          claimed_inodes, free_inodes);
+    CHECK(claimed_blocks == free_blocks, "claimed %" PRIu64 " of %" PRIu64 " free blocks",
+          claimed_blocks, free_blocks);
+    CHECK(image_free_inode_count(&img) == 0, "%" PRIu64 " inodes left free", image_free_inode_count(&img));
+    CHECK(image_free_block_count(&img) == 0, "%" PRIu64 " blocks left free", image_free_block_count(&img));
+    
+    // Give it all back, again from all threads at once
+    CHECK(image_concurrent_begin(&img) == 0, "cannot start concurrent release");
+    CHECK(run_threads(threads, release_worker) == 0, "cannot start release threads");
+    CHECK(image_concurrent_end(&img) == 0, "cannot rebuild indexes");
+    CHECK(image_free_inode_count(&img) == free_inodes, "%" PRIu64 " inodes free after release",
+          image_free_inode_count(&img));
+    CHECK(image_free_block_count(&img) == free_blocks, "%" PRIu64 " blocks free after release",
+          image_free_block_count(&img));
+    size_t restored_size;
+    uint8_t* restored = snapshot_bitmaps(&img, &restored_size);
+    CHECK(restored && restored_size == snapshot_size && memcmp(restored, snapshot, snapshot_size) == 0,
+          "bitmaps differ after release");
+    
+    for (uint32_t t = 0; t < CLAIM_THREADS; t++) {
+        free(threads[t].inodes);
+        free(threads[t].runs);
+    }
+    free(restored);
+    free(snapshot);
+    free(inode_owner);
+    free(block_owner);
+    CHECK(image_close(&img) == 0, "cannot close image");
+    
+    if (test_failures != 0) {
+        fprintf(stderr, "test_claim: %d check(s) failed\n", test_failures);
+        return 1;
+    }
+    printf("test_claim: %" PRIu64 " inodes and %" PRIu64 " blocks claimed once each by %d threads\n",
+           claimed_inodes, claimed_blocks, CLAIM_THREADS);
+    return 0;
+}
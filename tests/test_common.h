@@ -0,0 +1,20 @@
+#ifndef TEST_COMMON_H
+#define TEST_COMMON_H
+
+#include "minivsfs.h"
+
+// Failed checks so far; main returns nonzero if any
+static int test_failures = 0;
+
+// Report a failed condition with its location and keep going
+#define CHECK(cond, ...)                                                      \
+    do {                                                                      \
+        if (!(cond)) {                                                        \
+            fprintf(stderr, "%s:%d: check failed: %s: ", __FILE__, __LINE__, #cond); \
+            fprintf(stderr, __VA_ARGS__);                                     \
+            fputc('\n', stderr);                                              \
+            test_failures++;                                                  \
+        }                                                                     \
+    } while (0)
+
+#endif // TEST_COMMON_H
@@ -0,0 +1,94 @@
+// CRC32 test: the slice-by-8 table path, the PCLMULQDQ folding path (when
+// the CPU has it) and crc32() itself must match a bit-at-a-time reference
+// for every length and alignment. The utilities are included directly so
+// the static implementations can be called.
+//
+// Usage: test_crc32
+
+#include "test_common.h"
+#include "minivsfs_utils.c"
+
+#define CRC32_MAX_LENGTH 1100   // Covers several 64-byte folds and every tail
+#define CRC32_ALIGNMENTS 16
+#define CRC32_LARGE_LENGTH (1u << 20)
+
+// One bit at a time, straight from the reflected polynomial
+static uint32_t crc32_bitwise(const uint8_t* p, size_t n) {
+    uint32_t c = 0xFFFFFFFFu;
+    for (size_t i = 0; i < n; i++) {
+        c ^= p[i];
+        for (int bit = 0; bit < 8; bit++) {
+            c = (c >> 1) ^ (0xEDB88320u & (0u - (c & 1)));
+        }
+    }
+    return c ^ 0xFFFFFFFFu;
+}
+
+static uint32_t crc32_table(const uint8_t* p, size_t n) {
+    return crc32_update_table(0xFFFFFFFFu, p, n) ^ 0xFFFFFFFFu;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+static uint32_t crc32_pclmul(const uint8_t* p, size_t n) {
+    return crc32_update_pclmul(0xFFFFFFFFu, p, n) ^ 0xFFFFFFFFu;
+}
+#endif
+
+int main(void) {
+    int have_pclmul = 0;
+#if defined(__x86_64__) && defined(__GNUC__)
+    have_pclmul = cpu_has_pclmul();
+#endif
+    
+    // Fixed pseudo-random input, so failures reproduce
+    uint8_t* buffer = malloc(CRC32_LARGE_LENGTH + CRC32_ALIGNMENTS);
+    if (!buffer) {
+        print_error("Cannot allocate memory for the test");
+        return 1;
+    }
+    uint32_t seed = 0x12345678u;
+    for (size_t i = 0; i < CRC32_LARGE_LENGTH + CRC32_ALIGNMENTS; i++) {
+        seed = seed * 1103515245u + 12345u;
+        buffer[i] = (uint8_t)(seed >> 16);
+    }
+    
+    // Standard check value
+    CHECK(crc32_bitwise((const uint8_t*)"123456789", 9) == 0xCBF43926u, "bitwise reference is wrong");
+    CHECK(crc32_table((const uint8_t*)"123456789", 9) == 0xCBF43926u, "slice-by-8 check value");
+    CHECK(crc32("123456789", 9) == 0xCBF43926u, "crc32() check value");
+    
+    uint64_t cases = 0;
+    for (size_t align = 0; align < CRC32_ALIGNMENTS; align++) {
+        for (size_t n = 0; n <= CRC32_MAX_LENGTH; n++) {
+            const uint8_t* p = buffer + align;
+            uint32_t expected = crc32_bitwise(p, n);
+            CHECK(crc32_table(p, n) == expected, "slice-by-8, length %zu, alignment %zu", n, align);
+            CHECK(crc32(p, n) == expected, "crc32(), length %zu, alignment %zu", n, align);
+#if defined(__x86_64__) && defined(__GNUC__)
+            if (have_pclmul) {
+                CHECK(crc32_pclmul(p, n) == expected, "PCLMULQDQ, length %zu, alignment %zu", n, align);
+            }
+#endif
+            cases++;
+        }
+    }
+    
+    // One long input, so the four-lane folding loop runs many times
+    uint32_t expected = crc32_bitwise(buffer + 3, CRC32_LARGE_LENGTH);
+    CHECK(crc32_table(buffer + 3, CRC32_LARGE_LENGTH) == expected, "slice-by-8, 1 MiB");
+    CHECK(crc32(buffer + 3, CRC32_LARGE_LENGTH) == expected, "crc32(), 1 MiB");
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (have_pclmul) {
+        CHECK(crc32_pclmul(buffer + 3, CRC32_LARGE_LENGTH) == expected, "PCLMULQDQ, 1 MiB");
+    }
+#endif
+    free(buffer);
+    
+    if (test_failures != 0) {
+        fprintf(stderr, "test_crc32: %d check(s) failed\n", test_failures);
+        return 1;
+    }
+    printf("test_crc32: %" PRIu64 " lengths and alignments match the bitwise reference (%s)\n", cases,
+           have_pclmul ? "slice-by-8 and PCLMULQDQ" : "slice-by-8; no PCLMULQDQ on this CPU");
+    return 0;
+}
@@ -0,0 +1,141 @@
+// Directory index test: adds enough names to the root of a --dir-index
+// image that the index root (494 entries) overflows and the index grows
+// to two levels, then checks that every name is found, that absent names
+// are not, that each leaf holds only names its index entry covers and
+// that no entry was lost or duplicated, before and after reopening.
+//
+// Usage: test_dir_index <image> <name count>
+
+#include "test_common.h"
+
+#define ABSENT_PROBES 1000
+#define ROOT_INDEX_LIMIT ((BS - DIR_INDEX_ROOT_OFFSET - sizeof(dir_index_header_t)) / sizeof(dir_index_entry_t))
+
+static const dir_index_entry_t* index_entries(const dir_index_header_t* node) {
+    return (const dir_index_entry_t*)(node + 1);
+}
+
+static const dir_index_header_t* index_root(fs_image_t* img, const inode_t* dir) {
+    return (const dir_index_header_t*)(image_block(img, inode_block_at(img, dir, 0)) + DIR_INDEX_ROOT_OFFSET);
+}
+
+// Check one leaf against the hash range [low, high] its index entry covers.
+// Returns the names it holds.
+static uint64_t check_leaf(fs_image_t* img, const inode_t* dir, uint32_t dir_block, uint32_t low,
+                           uint32_t high) {
+    const dirent64_t* entries = (const dirent64_t*)image_block(img, inode_block_at(img, dir, dir_block));
+    uint64_t names = 0;
+    for (uint32_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
+        if (entries[i].inode_no == 0) {
+            continue;
+        }
+        uint32_t hash = dir_name_hash(entries[i].name);
+        CHECK(hash >= low && hash <= high, "%s in leaf %u is outside [%08x, %08x]", entries[i].name,
+              dir_block, low, high);
+        names++;
+    }
+    return names;
+}
+
+// Walk the whole index: count leaves and the names in them
+static uint64_t check_index(fs_image_t* img, uint32_t dir_ino, uint64_t* leaves) {
+    const inode_t* dir = image_inode(img, dir_ino);
+    const dir_index_header_t* root = index_root(img, dir);
+    *leaves = 0;
+    CHECK(root->magic == DIR_INDEX_MAGIC, "root index magic %08x", root->magic);
+    CHECK(root->levels == 1, "index has %u levels below the root, expected 1", root->levels);
+    if (root->magic != DIR_INDEX_MAGIC || root->levels != 1) {
+        return 0;
+    }
+    
+    uint64_t names = 0;
+    for (uint16_t r = 0; r < root->count; r++) {
+        uint32_t node_low = index_entries(root)[r].hash;
+        uint32_t node_high = r + 1 < root->count ? index_entries(root)[r + 1].hash - 1 : UINT32_MAX;
+        const dir_index_header_t* node = (const dir_index_header_t*)image_block(
+            img, inode_block_at(img, dir, index_entries(root)[r].block));
+        CHECK(node->magic == DIR_INDEX_MAGIC && node->count > 0 && node->count <= node->limit,
+              "index node %u is damaged", r);
+        for (uint16_t n = 0; n < node->count; n++) {
+            uint32_t low = index_entries(node)[n].hash;
+            uint32_t high = n + 1 < node->count ? index_entries(node)[n + 1].hash - 1 : node_high;
+            CHECK(n == 0 || low > index_entries(node)[n - 1].hash, "index node %u is not sorted", r);
+            CHECK(low >= node_low || n == 0, "index node %u reaches below its range", r);
+            names += check_leaf(img, dir, index_entries(node)[n].block, n == 0 ? node_low : low, high);
+            (*leaves)++;
+        }
+    }
+    return names;
+}
+
+// Look every added name up, and some that were never added
+static void check_lookups(fs_image_t* img, const uint32_t* inodes, uint32_t count) {
+    char name[DIRENT_NAME_MAX + 1];
+    for (uint32_t i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "file-%06u", i);
+        dirent64_t* entry = dir_lookup(img, ROOT_INO, name);
+        CHECK(entry && entry->inode_no == inodes[i], "%s not found or has the wrong inode", name);
+    }
+    for (uint32_t i = 0; i < ABSENT_PROBES; i++) {
+        snprintf(name, sizeof(name), "absent-%06u", i);
+        CHECK(dir_lookup(img, ROOT_INO, name) == NULL, "%s found but never added", name);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <image> <name count>\n", argv[0]);
+        return 2;
+    }
+    uint32_t count = (uint32_t)strtoul(argv[2], NULL, 10);
+    uint32_t* inodes = calloc(count ? count : 1, sizeof(uint32_t));
+    if (!inodes) {
+        print_error("Cannot allocate memory for the test");
+        return 1;
+    }
+    fs_image_t img;
+    if (image_open(&img, argv[1], 1) != 0) {
+        free(inodes);
+        return 1;
+    }
+    CHECK(dir_is_indexed(&img, image_inode(&img, ROOT_INO)), "root directory is not indexed");
+    
+    // Empty files, so only the directory grows
+    time_t now = time(NULL);
+    char name[DIRENT_NAME_MAX + 1];
+    for (uint32_t i = 0; i < count && test_failures == 0; i++) {
+        snprintf(name, sizeof(name), "file-%06u", i);
+        file_copy_t copy;
+        CHECK(image_alloc_file(&img, ROOT_INO, name, 0, now, &copy) == 0, "cannot allocate %s", name);
+        CHECK(dir_add_entry(&img, ROOT_INO, copy.inode_num, FILE_TYPE_REGULAR, name, now) == 0,
+              "cannot add %s", name);
+        inodes[i] = copy.inode_num;
+        file_copy_free(&copy);
+    }
+    image_update_superblock(&img, now);
+    
+    uint64_t leaves;
+    uint64_t names = check_index(&img, ROOT_INO, &leaves);
+    CHECK(names == count, "index holds %" PRIu64 " names, added %u", names, count);
+    CHECK(leaves > ROOT_INDEX_LIMIT, "only %" PRIu64 " leaves, not enough to overflow the %zu-entry root",
+          leaves, ROOT_INDEX_LIMIT);
+    check_lookups(&img, inodes, count);
+    CHECK(image_close(&img) == 0, "cannot close image");
+    
+    // Everything must have reached the image file
+    if (image_open(&img, argv[1], 0) != 0) {
+        free(inodes);
+        return 1;
+    }
+    CHECK(check_index(&img, ROOT_INO, &leaves) == count, "names lost after reopening");
+    check_lookups(&img, inodes, count);
+    image_close(&img);
+    free(inodes);
+    
+    if (test_failures != 0) {
+        fprintf(stderr, "test_dir_index: %d check(s) failed\n", test_failures);
+        return 1;
+    }
+    printf("test_dir_index: %u names in %" PRIu64 " leaves under a two-level index\n", count, leaves);
+    return 0;
+}
@@ -0,0 +1,162 @@
+// Extent overflow test: fragments the free space of an --extents image into
+// single-block holes, then adds a file that needs far more than the
+// INODE_EXTENTS runs the inode holds, so the rest go to an overflow extent
+// block. Checks that releasing such a file frees every block including the
+// overflow block, then that the extent list, the file content and the
+// bitmaps are right and survive reopening.
+//
+// Usage: test_extents <image> <host file of more than INODE_EXTENTS blocks>
+
+#include "test_common.h"
+
+#define HOLE_NAME "fragmented.bin"
+
+static int data_bit_is_set(fs_image_t* img, uint64_t block) {
+    for (uint32_t g = 0; g < img->group_count; g++) {
+        fs_group_t* group = &img->groups[g];
+        if (block >= group->data_region_start && block < group->data_region_start + group->data_region_blocks) {
+            uint32_t bit = (uint32_t)(block - group->data_region_start);
+            return (group->data_bitmap[bit / 8] >> (bit % 8)) & 1;
+        }
+    }
+    return 0;
+}
+
+// Take every free data block one at a time, then give back every other
+// one, leaving only single-block holes
+static int fragment_free_space(fs_image_t* img) {
+    uint64_t free_blocks = image_free_block_count(img);
+    uint32_t* blocks = malloc((free_blocks ? free_blocks : 1) * sizeof(uint32_t));
+    if (!blocks) {
+        return -1;
+    }
+    for (uint64_t i = 0; i < free_blocks; i++) {
+        extent_t extent;
+        if (image_alloc_blocks(img, 0, 1, &extent, 1) != 1) {
+            free(blocks);
+            return -1;
+        }
+        blocks[i] = extent.start;
+    }
+    for (uint64_t i = 0; i < free_blocks; i += 2) {
+        image_free_blocks(img, blocks[i], 1);
+    }
+    free(blocks);
+    return 0;
+}
+
+// Whether the file's blocks hold exactly the host file's bytes
+static int content_matches(fs_image_t* img, const inode_t* inode, const uint8_t* content, uint64_t size) {
+    if (inode->size_bytes != size) {
+        return 0;
+    }
+    for (uint64_t offset = 0; offset < size; offset += BS) {
+        uint32_t block = inode_block_at(img, inode, offset / BS);
+        uint64_t length = size - offset < BS ? size - offset : BS;
+        if (block == 0 || memcmp(image_block(img, block), content + offset, length) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Check the extent list: more runs than the inode holds, every block in use,
+// none of them the overflow block, and lengths adding up to the file size.
+// Returns the extent count.
+static uint32_t check_extents(fs_image_t* img, const inode_t* inode, uint64_t block_count) {
+    CHECK(inode->indirect != 0, "no overflow extent block");
+    CHECK(inode->indirect == 0 || data_bit_is_set(img, inode->indirect), "overflow block %u is free",
+          inode->indirect);
+    uint64_t mapped = 0;
+    uint32_t count = 0;
+    const extent_t* extent;
+    while ((extent = inode_extent(img, inode, count)) != NULL) {
+        CHECK(extent->length > 0, "extent %u is empty", count);
+        for (uint32_t b = 0; b < extent->length; b++) {
+            uint64_t block = (uint64_t)extent->start + b;
+            CHECK(data_bit_is_set(img, block), "block %" PRIu64 " of extent %u is free", block, count);
+            CHECK(block != inode->indirect, "extent %u covers the overflow block", count);
+        }
+        mapped += extent->length;
+        count++;
+    }
+    CHECK(count > INODE_EXTENTS, "only %u extents, the overflow block is not used", count);
+    CHECK(mapped == block_count, "extents map %" PRIu64 " blocks, file has %" PRIu64, mapped, block_count);
+    return count;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <image> <host file of more than %d blocks>\n", argv[0], INODE_EXTENTS);
+        return 2;
+    }
+    const char* host_path = argv[2];
+    uint64_t size;
+    uint8_t* content = read_file_content(host_path, &size);
+    if (!content) {
+        return 1;
+    }
+    uint64_t block_count = (size + BS - 1) / BS;
+    fs_image_t img;
+    if (image_open(&img, argv[1], 1) != 0) {
+        free(content);
+        return 1;
+    }
+    CHECK(img.sb->flags & FS_FLAG_EXTENTS, "image is not extent-mapped");
+    CHECK(block_count > INODE_EXTENTS, "host file is too small to need an overflow block");
+    
+    CHECK(fragment_free_space(&img) == 0, "cannot fragment the free space");
+    uint64_t holes = image_free_block_count(&img);
+    CHECK(image_largest_free_extent(&img) == 1, "largest free run is %u blocks", image_largest_free_extent(&img));
+    CHECK(holes > block_count, "only %" PRIu64 " holes for %" PRIu64 " blocks", holes, block_count);
+    if (test_failures != 0) {
+        free(content);
+        image_close(&img);
+        return 1;
+    }
+    
+    // Releasing a file gives back its data blocks and the overflow block
+    time_t now = time(NULL);
+    file_copy_t copy;
+    CHECK(image_alloc_file(&img, ROOT_INO, host_path, size, now, &copy) == 0, "cannot allocate %s", HOLE_NAME);
+    check_extents(&img, image_inode(&img, copy.inode_num), block_count);
+    CHECK(image_free_block_count(&img) == holes - block_count - 1,
+          "%" PRIu64 " blocks free, expected %" PRIu64, image_free_block_count(&img), holes - block_count - 1);
+    image_release_file(&img, &copy);
+    CHECK(image_free_block_count(&img) == holes, "%" PRIu64 " blocks free after release, expected %" PRIu64,
+          image_free_block_count(&img), holes);
+    
+    // Add it for good through the same path as mkfs_adder
+    CHECK(image_alloc_file(&img, ROOT_INO, host_path, size, now, &copy) == 0, "cannot allocate %s", HOLE_NAME);
+    CHECK(file_copy_read(&img, &copy) == 0, "cannot copy %s", host_path);
+    CHECK(dir_add_entry(&img, ROOT_INO, copy.inode_num, FILE_TYPE_REGULAR, HOLE_NAME, now) == 0,
+          "cannot link %s", HOLE_NAME);
+    uint32_t inode_num = copy.inode_num;
+    file_copy_free(&copy);
+    inode_t* inode = image_inode(&img, inode_num);
+    uint32_t extents = check_extents(&img, inode, block_count);
+    CHECK(content_matches(&img, inode, content, size), "content differs");
+    image_update_superblock(&img, now);
+    CHECK(image_close(&img) == 0, "cannot close image");
+    
+    // The overflow block must have reached the image file
+    if (image_open(&img, argv[1], 0) != 0) {
+        free(content);
+        return 1;
+    }
+    dirent64_t* entry = dir_lookup(&img, ROOT_INO, HOLE_NAME);
+    CHECK(entry && entry->inode_no == inode_num, "%s not found after reopening", HOLE_NAME);
+    inode = image_inode(&img, inode_num);
+    CHECK(check_extents(&img, inode, block_count) == extents, "extent count changed after reopening");
+    CHECK(content_matches(&img, inode, content, size), "content differs after reopening");
+    image_close(&img);
+    free(content);
+    
+    if (test_failures != 0) {
+        fprintf(stderr, "test_extents: %d check(s) failed\n", test_failures);
+        return 1;
+    }
+    printf("test_extents: %" PRIu64 " blocks in %u extents, %u in the overflow block\n", block_count, extents,
+           extents - INODE_EXTENTS);
+    return 0;
+}
@@ -0,0 +1,140 @@
+// Version upgrade test: rewrites the superblock of a flat, featureless image
+// in the version 1 layout (checksum right after flags, no allocation hints
+// or group fields), then adds a file the way mkfs_adder does. The image
+// must open as version 1 without reading the old checksum as a hint, keep
+// its existing files, and come back as a valid current-version image.
+//
+// Usage: test_upgrade <image> <host file already in the image root>
+
+#include "test_common.h"
+#include <stddef.h>
+
+#define V1_CHECKSUM_OFFSET offsetof(superblock_t, inode_alloc_hint)
+#define UPGRADED_NAME "upgraded.txt"
+
+// Rewrite block 0 as a version 1 superblock
+static int downgrade_to_v1(const char* image_path) {
+    int fd = open(image_path, O_RDWR);
+    if (fd < 0) {
+        print_error("Cannot open image %s: %s", image_path, strerror(errno));
+        return -1;
+    }
+    uint8_t block[BS];
+    if (pread(fd, block, BS, 0) != (ssize_t)BS) {
+        print_error("Cannot read superblock");
+        close(fd);
+        return -1;
+    }
+    
+    uint8_t v1[BS];
+    memset(v1, 0, BS);
+    memcpy(v1, block, V1_CHECKSUM_OFFSET);
+    uint32_t version = 1;
+    memcpy(v1 + offsetof(superblock_t, version), &version, sizeof(version));
+    uint32_t checksum = crc32(v1, BS - 4);
+    memcpy(v1 + V1_CHECKSUM_OFFSET, &checksum, sizeof(checksum));
+    
+    int rc = pwrite(fd, v1, BS, 0) == (ssize_t)BS ? 0 : -1;
+    if (close(fd) != 0) {
+        rc = -1;
+    }
+    return rc;
+}
+
+// Whether the file named name in the root holds exactly the host file's bytes
+static int file_matches(fs_image_t* img, const char* name, const uint8_t* content, uint64_t size) {
+    dirent64_t* entry = dir_lookup(img, ROOT_INO, name);
+    if (!entry || entry->type != FILE_TYPE_REGULAR) {
+        return 0;
+    }
+    inode_t* inode = image_inode(img, entry->inode_no);
+    if (inode->size_bytes != size) {
+        return 0;
+    }
+    for (uint64_t offset = 0; offset < size; offset += BS) {
+        uint32_t block = inode_block_at(img, inode, offset / BS);
+        uint64_t length = size - offset < BS ? size - offset : BS;
+        if (block == 0 || memcmp(image_block(img, block), content + offset, length) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <image> <host file already in the image root>\n", argv[0]);
+        return 2;
+    }
+    const char* image_path = argv[1];
+    const char* host_path = argv[2];
+    const char* existing_name = extract_filename(host_path);
+    uint64_t size;
+    uint8_t* content = read_file_content(host_path, &size);
+    if (!content) {
+        return 1;
+    }
+    
+    fs_image_t img;
+    if (image_open(&img, image_path, 0) != 0) {
+        free(content);
+        return 1;
+    }
+    CHECK(img.sb->flags == 0, "image must be flat and featureless, flags 0x%x", img.sb->flags);
+    CHECK(file_matches(&img, existing_name, content, size), "%s missing before downgrade", existing_name);
+    image_close(&img);
+    if (test_failures != 0 || downgrade_to_v1(image_path) != 0) {
+        fprintf(stderr, "test_upgrade: cannot prepare a version 1 image\n");
+        free(content);
+        return 1;
+    }
+    
+    // Open as version 1 and add a file, as mkfs_adder would
+    if (image_open(&img, image_path, 1) != 0) {
+        fprintf(stderr, "test_upgrade: version 1 image does not open\n");
+        free(content);
+        return 1;
+    }
+    CHECK(img.sb->version == 1, "version %u", img.sb->version);
+    CHECK(img.inode_alloc_hint == 0 && img.data_alloc_hint == 0,
+          "version 1 hints must start at 0, got %u and %u", img.inode_alloc_hint, img.data_alloc_hint);
+    CHECK(file_matches(&img, existing_name, content, size), "%s unreadable as version 1", existing_name);
+    
+    time_t now = time(NULL);
+    file_copy_t copy;
+    int added = image_alloc_file(&img, ROOT_INO, host_path, size, now, &copy) == 0;
+    CHECK(added, "cannot allocate %s", UPGRADED_NAME);
+    if (added) {
+        CHECK(file_copy_read(&img, &copy) == 0, "cannot copy %s", host_path);
+        CHECK(dir_add_entry(&img, ROOT_INO, copy.inode_num, FILE_TYPE_REGULAR, UPGRADED_NAME, now) == 0,
+              "cannot link %s", UPGRADED_NAME);
+        file_copy_free(&copy);
+    }
+    image_update_superblock(&img, now);
+    CHECK(image_close(&img) == 0, "cannot close image");
+    
+    // The committed superblock is current and self-consistent
+    if (image_open(&img, image_path, 0) != 0) {
+        fprintf(stderr, "test_upgrade: upgraded image does not open\n");
+        free(content);
+        return 1;
+    }
+    superblock_t sb = *img.sb;
+    uint32_t stored = sb.checksum;
+    CHECK(sb.version == VERSION, "version %u after upgrade", sb.version);
+    CHECK(superblock_crc_finalize(&sb) == stored, "superblock checksum is stale");
+    CHECK(sb.flags == 0 && sb.group_count == 0 && sb.blocks_per_group == 0 && sb.inodes_per_group == 0,
+          "stale bytes left in the group fields");
+    CHECK(sb.inode_alloc_hint != 0 && sb.data_alloc_hint != 0, "allocation hints not stored");
+    CHECK(file_matches(&img, existing_name, content, size), "%s lost in the upgrade", existing_name);
+    CHECK(file_matches(&img, UPGRADED_NAME, content, size), "%s not added", UPGRADED_NAME);
+    image_close(&img);
+    free(content);
+    
+    if (test_failures != 0) {
+        fprintf(stderr, "test_upgrade: %d check(s) failed\n", test_failures);
+        return 1;
+    }
+    printf("test_upgrade: version 1 image upgraded to version %d with its files intact\n", VERSION);
+    return 0;
+}